@@ -0,0 +1,423 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+ * Microbenchmarks for the parser, word expansion and spawn paths.
+ *
+ * Results are printed to stdout as JSON, in the format used by Google
+ * Benchmark (so its compare.py can diff two runs). Each benchmark is
+ * calibrated to run for at least MIN_TIME_NS and repeated REPETITIONS
+ * times; the median repetition is reported.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cmd.h"
+#include "utils.h"
+#include "zygote.h"
+#include "../util/parser/ctree.h"
+
+#define MIN_TIME_NS	50000000ULL
+#define REPETITIONS	5
+#define MAX_LINES	1024
+
+struct lines {
+	char *text[MAX_LINES];
+	int count;
+};
+
+struct bench {
+	const char *name;
+	void (*setup)(void);
+	void (*run)(void);
+	void (*teardown)(void);
+};
+
+static struct lines seeds[3];
+static struct lines synthetic;
+static struct lines *current_lines;
+static command_t *current_root;
+static char *current_line;	/* the words of current_root point into it */
+static ct_tree_t current_compact;
+static volatile size_t walk_sink;
+
+static int benchmark_count;
+
+void parse_error(const char *str, const int where)
+{
+	/* Negative tests are expected to fail, stay quiet. */
+}
+
+static unsigned long long now_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Load every line of a seed file.
+ */
+static void load_lines(struct lines *lines, const char *dir, const char *name)
+{
+	char path[4096], buf[4096];
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	f = fopen(path, "r");
+	DIE(f == NULL, path);
+
+	while (lines->count < MAX_LINES && fgets(buf, sizeof(buf), f) != NULL) {
+		lines->text[lines->count] = strdup(buf);
+		DIE(lines->text[lines->count] == NULL, "strdup");
+		lines->count++;
+	}
+
+	fclose(f);
+}
+
+/**
+ * Build a line by repeating a pattern.
+ */
+static char *repeat(const char *head, const char *pattern, int times,
+					const char *tail)
+{
+	size_t len = strlen(head) + strlen(pattern) * times + strlen(tail) + 1;
+	char *line = malloc(len);
+
+	DIE(line == NULL, "malloc");
+	strcpy(line, head);
+	for (int i = 0; i < times; i++)
+		strcat(line, pattern);
+	strcat(line, tail);
+
+	return line;
+}
+
+static void parse_lines(void)
+{
+	for (int i = 0; i < current_lines->count; i++) {
+		command_t *root = NULL;
+
+		parse_line(current_lines->text[i], &root);
+		free_parse_memory();
+	}
+}
+
+static void use_small(void) { current_lines = &seeds[0]; }
+static void use_ugly(void) { current_lines = &seeds[1]; }
+static void use_negative(void) { current_lines = &seeds[2]; }
+
+static void use_synthetic(int index)
+{
+	current_lines = &synthetic;
+	synthetic.count = 1;
+	synthetic.text[0] = synthetic.text[index + 1];
+}
+
+static void use_long_argv(void) { use_synthetic(0); }
+static void use_deep_pipe(void) { use_synthetic(1); }
+static void use_long_quote(void) { use_synthetic(2); }
+static void use_long_vars(void) { use_synthetic(3); }
+static void use_long_mixed(void) { use_synthetic(4); }
+
+/**
+ * Parse a line once and keep its tree for the whole benchmark.
+ */
+static void parse_fixed(const char *line)
+{
+	current_root = NULL;
+	free_parse_memory();
+	DIE(!parse_line(line, &current_root) || current_root == NULL,
+		"parse_line");
+}
+
+static void setup_get_word(void)
+{
+	setenv("BENCH_A", "some value", 1);
+	setenv("BENCH_B", "/usr/local/bin:/usr/bin:/bin", 1);
+	parse_fixed("prefix$BENCH_A=infix$BENCH_B$BENCH_UNSET.suffix\n");
+}
+
+static void run_get_word(void)
+{
+	free(get_word(current_root->scmd->verb));
+}
+
+static void setup_get_argv(void)
+{
+	current_line = repeat("cmd", " argument$HOME", 64, "\n");
+	parse_fixed(current_line);
+}
+
+static void run_get_argv(void)
+{
+	int argc;
+	char **argv = get_argv(current_root->scmd, &argc);
+
+	for (int i = 0; i < argc; i++)
+		free(argv[i]);
+	free(argv);
+}
+
+static void setup_spawn(void) { parse_fixed("true\n"); }
+static void setup_spawn_pipe(void) { parse_fixed("true | true\n"); }
+static void setup_spawn_redirect(void) { parse_fixed("true > /dev/null\n"); }
+
+static void run_spawn(void)
+{
+	parse_command(current_root, 0, NULL);
+}
+
+static void teardown_tree(void)
+{
+	free_parse_memory();
+	current_root = NULL;
+	free(current_line);
+	current_line = NULL;
+}
+
+/*
+ * Spawn latency of an external command as the shell grows: the ballast is
+ * touched, so fork() has its page tables to copy, unless the spawn server
+ * (started first, while the shell is small) forks instead.
+ */
+static char *ballast;
+
+static void grow_shell(size_t size, bool zygote)
+{
+	if (zygote)
+		DIE(zygote_start() == -1, "zygote_start");
+	ballast = malloc(size);
+	DIE(ballast == NULL, "malloc");
+	memset(ballast, 1, size);
+	parse_fixed("/bin/true\n");
+}
+
+static void setup_fork_10MiB(void) { grow_shell(10 << 20, false); }
+static void setup_fork_1GiB(void) { grow_shell(1 << 30, false); }
+static void setup_zygote_10MiB(void) { grow_shell(10 << 20, true); }
+static void setup_zygote_1GiB(void) { grow_shell(1 << 30, true); }
+
+static void teardown_spawn_rss(void)
+{
+	free(ballast);
+	ballast = NULL;
+	zygote_stop();
+	teardown_tree();
+}
+
+/**
+ * Walk every part of every word of a tree, the way a consumer building
+ * argv / file names does, with the pointer tree or with the compact tree.
+ */
+static size_t walk_list(const word_t *w)
+{
+	size_t n = 0;
+
+	for (; w != NULL; w = w->next_word)
+		for (const word_t *part = w; part != NULL; part = part->next_part)
+			n += part->length;
+
+	return n;
+}
+
+static size_t walk_pointer(const command_t *c)
+{
+	const simple_command_t *s = c->scmd;
+
+	if (c->op != OP_NONE)
+		return walk_pointer(c->cmd1) + walk_pointer(c->cmd2);
+
+	return walk_list(s->verb) + walk_list(s->params) + walk_list(s->in) +
+		   walk_list(s->out) + walk_list(s->err);
+}
+
+static size_t walk_compact_list(const ct_tree_t *t, ct_index_t w)
+{
+	size_t n = 0;
+
+	for (; w != CT_NIL; w = t->next_word[w])
+		for (ct_index_t part = w; part != CT_NIL; part = t->next_part[part])
+			n += t->part_length[part];
+
+	return n;
+}
+
+static size_t walk_compact(const ct_tree_t *t, ct_index_t c)
+{
+	ct_index_t s = t->scmd[c];
+
+	if (t->op[c] != OP_NONE)
+		return walk_compact(t, t->cmd1[c]) + walk_compact(t, t->cmd2[c]);
+
+	return walk_compact_list(t, t->verb[s]) +
+		   walk_compact_list(t, t->params[s]) +
+		   walk_compact_list(t, t->in[s]) + walk_compact_list(t, t->out[s]) +
+		   walk_compact_list(t, t->err[s]);
+}
+
+static void setup_walk(void)
+{
+	parse_fixed(synthetic.text[4]);
+	ct_from_command(&current_compact, current_root);
+}
+
+static void run_walk_pointer(void)
+{
+	walk_sink = walk_pointer(current_root);
+}
+
+static void run_walk_compact(void)
+{
+	walk_sink = walk_compact(&current_compact, current_compact.root);
+}
+
+static void run_compact_copy(void)
+{
+	ct_from_command(&current_compact, current_root);
+}
+
+static const struct bench benches[] = {
+	{ "parse_line/small_tests", use_small, parse_lines, NULL },
+	{ "parse_line/ugly_tests", use_ugly, parse_lines, NULL },
+	{ "parse_line/negative_tests", use_negative, parse_lines, NULL },
+	{ "parse_line/argv_4096", use_long_argv, parse_lines, NULL },
+	{ "parse_line/argv_vars_4096", use_long_vars, parse_lines, NULL },
+	{ "parse_line/argv_quoted_4096", use_long_mixed, parse_lines, NULL },
+	{ "parse_line/pipe_depth_1024", use_deep_pipe, parse_lines, NULL },
+	{ "parse_line/quoted_64KiB", use_long_quote, parse_lines, NULL },
+	{ "tree_walk/pointer_argv_vars_4096", setup_walk, run_walk_pointer,
+	  teardown_tree },
+	{ "tree_walk/compact_argv_vars_4096", setup_walk, run_walk_compact,
+	  teardown_tree },
+	{ "ct_from_command/argv_vars_4096", setup_walk, run_compact_copy,
+	  teardown_tree },
+	{ "get_word/expand_parts", setup_get_word, run_get_word, teardown_tree },
+	{ "get_argv/params_64", setup_get_argv, run_get_argv, teardown_tree },
+	{ "parse_simple/spawn_true", setup_spawn, run_spawn, teardown_tree },
+	{ "parse_simple/spawn_redirect", setup_spawn_redirect, run_spawn,
+	  teardown_tree },
+	{ "run_on_pipe/spawn_true_pipe", setup_spawn_pipe, run_spawn,
+	  teardown_tree },
+	{ "parse_simple/spawn_bin_true_rss_10MiB", setup_fork_10MiB, run_spawn,
+	  teardown_spawn_rss },
+	{ "parse_simple/spawn_bin_true_rss_1GiB", setup_fork_1GiB, run_spawn,
+	  teardown_spawn_rss },
+	{ "zygote_spawn/spawn_bin_true_rss_10MiB", setup_zygote_10MiB, run_spawn,
+	  teardown_spawn_rss },
+	{ "zygote_spawn/spawn_bin_true_rss_1GiB", setup_zygote_1GiB, run_spawn,
+	  teardown_spawn_rss },
+};
+
+static int compare_ull(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * Run a benchmark n times and return the elapsed wall time.
+ */
+static unsigned long long time_iterations(const struct bench *b,
+										  unsigned long long n,
+										  unsigned long long *cpu)
+{
+	unsigned long long start = now_ns(CLOCK_MONOTONIC);
+	unsigned long long cpu_start = now_ns(CLOCK_PROCESS_CPUTIME_ID);
+
+	for (unsigned long long i = 0; i < n; i++)
+		b->run();
+
+	*cpu = now_ns(CLOCK_PROCESS_CPUTIME_ID) - cpu_start;
+	return now_ns(CLOCK_MONOTONIC) - start;
+}
+
+static void run_bench(const struct bench *b)
+{
+	unsigned long long iterations = 1, elapsed, cpu;
+	unsigned long long real[REPETITIONS], cpus[REPETITIONS];
+
+	if (b->setup != NULL)
+		b->setup();
+
+	// Calibrate the number of iterations
+	for (;;) {
+		elapsed = time_iterations(b, iterations, &cpu);
+		if (elapsed >= MIN_TIME_NS || iterations >= (1ULL << 30))
+			break;
+		iterations *= elapsed > 0 && MIN_TIME_NS / elapsed < 10 ? 2 : 10;
+	}
+
+	for (int i = 0; i < REPETITIONS; i++) {
+		real[i] = time_iterations(b, iterations, &cpu);
+		cpus[i] = cpu;
+	}
+
+	if (b->teardown != NULL)
+		b->teardown();
+
+	qsort(real, REPETITIONS, sizeof(real[0]), compare_ull);
+	qsort(cpus, REPETITIONS, sizeof(cpus[0]), compare_ull);
+
+	printf("%s\n    {\n", benchmark_count++ > 0 ? "," : "");
+	printf("      \"name\": \"%s_median\",\n", b->name);
+	printf("      \"run_name\": \"%s\",\n", b->name);
+	printf("      \"run_type\": \"aggregate\",\n");
+	printf("      \"aggregate_name\": \"median\",\n");
+	printf("      \"repetitions\": %d,\n", REPETITIONS);
+	printf("      \"iterations\": %llu,\n", iterations);
+	printf("      \"real_time\": %.1f,\n",
+		   (double)real[REPETITIONS / 2] / iterations);
+	printf("      \"cpu_time\": %.1f,\n",
+		   (double)cpus[REPETITIONS / 2] / iterations);
+	printf("      \"min_real_time\": %.1f,\n", (double)real[0] / iterations);
+	printf("      \"time_unit\": \"ns\"\n");
+	printf("    }");
+	fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *seed_dir = "../util/parser/tests";
+	const char *filter = NULL;
+
+	for (int i = 1; i < argc; i++) {
+		if (strncmp(argv[i], "--filter=", 9) == 0)
+			filter = argv[i] + 9;
+		else
+			seed_dir = argv[i];
+	}
+
+	load_lines(&seeds[0], seed_dir, "small_tests.txt");
+	load_lines(&seeds[1], seed_dir, "ugly_tests.txt");
+	load_lines(&seeds[2], seed_dir, "negative_tests.txt");
+
+	synthetic.text[1] = repeat("cmd", " arg", 4096, "\n");
+	synthetic.text[2] = repeat("a", " | a", 1024, "\n");
+	synthetic.text[3] = repeat("echo '", "x", 64 * 1024, "'\n");
+	synthetic.text[4] = repeat("cmd", " --opt=$HOME/some/path.txt", 4096, "\n");
+	// A single quoted word sends the whole line to flex
+	synthetic.text[5] = repeat("cmd", " --opt=$HOME/some/path.txt", 4096,
+							   " 'q'\n");
+
+	printf("{\n  \"context\": {\n");
+	printf("    \"executable\": \"%s\",\n", argv[0]);
+	printf("    \"num_cpus\": %ld,\n", sysconf(_SC_NPROCESSORS_ONLN));
+	printf("    \"library_build_type\": \"mini-shell\"\n");
+	printf("  },\n  \"benchmarks\": [");
+
+	for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++)
+		if (filter == NULL || strstr(benches[i].name, filter) != NULL)
+			run_bench(&benches[i]);
+
+	printf("\n  ]\n}\n");
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,64 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+ * Run a command with its stdin read from a file and print its wall time,
+ * CPU time and peak RSS (as reported by wait4()) on a single line:
+ *
+ *   wall_s user_s sys_s maxrss_kb exit_status
+ */
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+int main(int argc, char *argv[])
+{
+	struct timespec start, end;
+	struct rusage usage;
+	int status, fd;
+	pid_t pid;
+
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s input-file command [args...]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	pid = fork();
+	DIE(pid == -1, "fork");
+
+	if (pid == 0) {
+		fd = open(argv[1], O_RDONLY);
+		DIE(fd == -1, argv[1]);
+		dup2(fd, STDIN_FILENO);
+		close(fd);
+
+		fd = open("/dev/null", O_WRONLY);
+		DIE(fd == -1, "/dev/null");
+		dup2(fd, STDOUT_FILENO);
+		dup2(fd, STDERR_FILENO);
+		close(fd);
+
+		execvp(argv[2], argv + 2);
+		exit(127);
+	}
+
+	DIE(wait4(pid, &status, 0, &usage) == -1, "wait4");
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	printf("%.6f %.6f %.6f %ld %d\n",
+		   (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9,
+		   usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6,
+		   usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6,
+		   usage.ru_maxrss, WEXITSTATUS(status));
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,173 @@
+#!/bin/bash
+# SPDX-License-Identifier: BSD-3-Clause
+#
+# End-to-end throughput benchmark of mini-shell against bash and dash.
+#
+# Replays the functional test inputs (tests/_test/inputs) and a few synthetic
+# workloads through every shell and reports, for each pair, the number of
+# commands per second, total CPU time (user + sys, children included), peak
+# RSS and, when strace is installed, the number of system calls.
+#
+# The startup_c workload measures startup-to-exit latency instead: it runs
+# "<shell> -c true" STARTUP_RUNS times from a dash loop.
+#
+# Usage: ./shell_bench.sh [workload...]
+#   RUNS      - runs per measurement, the median wall time is kept (default 3)
+#   SHELLS    - shells to compare (default "mini-shell bash dash")
+#   SRC_PATH  - directory holding the mini-shell binary (default ../src)
+
+RUNS=${RUNS:-3}
+STARTUP_RUNS=${STARTUP_RUNS:-1000}
+SHELLS=${SHELLS:-"mini-shell bash dash"}
+SRC_PATH=${SRC_PATH:-$(pwd)/../src}
+INPUT_DIR=$(pwd)/../tests/_test/inputs
+RUNSTAT=$(pwd)/runstat
+
+WORK_DIR=$(mktemp -d)
+trap 'rm -rf "$WORK_DIR"' EXIT
+
+if ! [ -x "$RUNSTAT" ]; then
+	echo "runstat not found, run make first" 1>&2
+	exit 1
+fi
+
+# ----------------- Workloads ------------------------------------------------ #
+
+# Each workload is a script in $WORK_DIR/<name>.sh; the number of simple
+# commands it runs is stored in $WORK_DIR/<name>.cmds.
+
+# Count simple commands: lines plus operators found outside quotes.
+count_commands() {
+	sed "s/'[^']*'//g; s/\"[^\"]*\"//g" "$1" |
+		awk '{ n++; n += gsub(/&&|\|\||[|;&]/, "") } END { print n }'
+}
+
+add_workload() {
+	local name=$1
+
+	cat >"$WORK_DIR/$name.sh"
+	count_commands "$WORK_DIR/$name.sh" >"$WORK_DIR/$name.cmds"
+}
+
+generate_workloads() {
+	local i
+
+	for f in "$INPUT_DIR"/test_*.txt; do
+		add_workload "$(basename "$f" .txt)" <"$f"
+	done
+
+	for ((i = 0; i < 10000; i++)); do
+		echo "true"
+	done | add_workload trivial_10k
+
+	for ((i = 0; i < 100; i++)); do
+		echo "echo x | cat | cat | cat | cat | cat | cat | cat | cat | cat | cat | cat | cat | cat | cat | cat"
+	done | add_workload pipeline_16x100
+
+	for ((i = 0; i < 100; i++)); do
+		echo "true & true & true & true & true & true & true & true & true & true & true & true & true & true & true & true"
+	done | add_workload fanout_16x100
+
+	head -c $((64 * 1024 * 1024)) /dev/zero >"$WORK_DIR/big_file"
+	for ((i = 0; i < 10; i++)); do
+		echo "cat < $WORK_DIR/big_file > big_out"
+	done | add_workload redirect_64MiBx10
+
+	# Multiple output redirections: every file gets the whole stream (in
+	# shells with multios, the others only write the last one)
+	for n in 1 2 4; do
+		for ((i = 0; i < 10; i++)); do
+			echo -n "cat < $WORK_DIR/big_file"
+			for ((j = 1; j <= n; j++)); do
+				echo -n " > big_out$j"
+			done
+			echo
+		done | add_workload "multios_${n}x64MiBx10"
+	done
+
+	# Driver for startup_c, the shell under test is passed as $0
+	echo "i=0; while [ \$i -lt $STARTUP_RUNS ]; do \"\$0\" -c true; i=\$((i + 1)); done" \
+		>"$WORK_DIR/startup_c.driver"
+	echo "$STARTUP_RUNS" >"$WORK_DIR/startup_c.cmds"
+}
+
+# ----------------- Measurements --------------------------------------------- #
+
+shell_path() {
+	if [ "$1" = "mini-shell" ]; then
+		echo "$SRC_PATH/mini-shell"
+	else
+		command -v "$1"
+	fi
+}
+
+# Run a workload once in a fresh directory, print the runstat line.
+run_once() {
+	local shell=$1 workload=$2
+
+	rm -rf "$WORK_DIR/run" && mkdir "$WORK_DIR/run" && cd "$WORK_DIR/run" || exit 1
+	if [ "$workload" = "startup_c" ]; then
+		"$RUNSTAT" /dev/null dash -c "$(cat "$WORK_DIR/startup_c.driver")" "$shell"
+	else
+		"$RUNSTAT" "$WORK_DIR/$workload.sh" "$shell"
+	fi
+	cd - &>/dev/null || exit 1
+}
+
+count_syscalls() {
+	local shell=$1 workload=$2
+
+	if ! command -v strace &>/dev/null || [ "$workload" = "startup_c" ]; then
+		echo "-"
+		return
+	fi
+
+	rm -rf "$WORK_DIR/run" && mkdir "$WORK_DIR/run" && cd "$WORK_DIR/run" || exit 1
+	strace -f -c -o "$WORK_DIR/strace.out" "$shell" \
+		<"$WORK_DIR/$workload.sh" &>/dev/null
+	cd - &>/dev/null || exit 1
+	awk '$NF == "total" { print $(NF - 2) }' "$WORK_DIR/strace.out"
+}
+
+measure() {
+	local shell=$1 workload=$2 commands
+	local -a runs
+
+	commands=$(cat "$WORK_DIR/$workload.cmds")
+	mapfile -t runs < <(for ((r = 0; r < RUNS; r++)); do
+		run_once "$shell" "$workload"
+	done | sort -n)
+
+	# Median run: wall user sys maxrss status
+	read -r wall user sys maxrss _ <<<"${runs[$((RUNS / 2))]}"
+
+	awk -v w="$workload" -v s="$(basename "$shell")" -v n="$commands" \
+		-v wall="$wall" -v cpu="$user $sys" -v rss="$maxrss" \
+		-v sc="$(count_syscalls "$shell" "$workload")" 'BEGIN {
+		split(cpu, t, " ")
+		printf "%-20s %-12s %8d %10.3f %12.0f %10.3f %12d %10s\n",
+			w, s, n, wall, (wall > 0 ? n / wall : 0), t[1] + t[2], rss, sc
+	}'
+}
+
+generate_workloads
+
+if [ $# -gt 0 ]; then
+	workloads=("$@")
+else
+	mapfile -t workloads < <(cd "$WORK_DIR" && ls ./*.cmds | sed 's|^\./||; s|\.cmds$||')
+fi
+
+printf "%-20s %-12s %8s %10s %12s %10s %12s %10s\n" "workload" "shell" \
+	"commands" "wall(s)" "commands/s" "cpu(s)" "maxrss(KB)" "syscalls"
+
+for workload in "${workloads[@]}"; do
+	for name in $SHELLS; do
+		shell=$(shell_path "$name")
+		if [ -z "$shell" ] || ! [ -x "$shell" ]; then
+			echo "$name not found, skipping" 1>&2
+			continue
+		fi
+		measure "$shell" "$workload"
+	done
+done
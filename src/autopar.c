@@ -0,0 +1,637 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "autopar.h"
+#include "cmd.h"
+#include "timing.h"
+#include "utils.h"
+
+/*
+ * The shell's stdout and stderr, written by every job that does not
+ * redirect them, so that their output keeps its order (resolved paths
+ * start with '/').
+ */
+#define STDOUT_RESOURCE	"<stdout>"
+#define STDERR_RESOURCE	"<stderr>"
+
+/* Where a descriptor of a job ends up. */
+#define TO_OTHER	0
+#define TO_STDOUT	1
+#define TO_STDERR	2
+
+/* A file a job reads or writes. */
+struct access {
+	char *path;
+	size_t job;
+	bool write;
+};
+
+/* A command of the ; sequence. */
+struct job {
+	command_t *cmd;
+	command_t *father;
+	size_t *dependents;
+	size_t dependent_count, dependent_size;
+	size_t waiting;
+	pid_t pid;
+	int status;
+};
+
+/* The commands of a sequence and the files of the part being run. */
+struct graph {
+	struct job *jobs;
+	size_t job_count, job_size;
+	struct access *accesses;
+	size_t access_count, access_size;
+};
+
+/* Commands that change the state of the shell (time, for what it times). */
+static const char * const shell_commands[] = {
+	"exit", "quit", "cd", "set", "shellstats", "time",
+};
+
+/*
+ * Commands that only read the files their operands name; the operands of
+ * any other command may be written too (cp a b, mkdir d, sort -o f).
+ */
+static const char * const reading_commands[] = {
+	"basename", "cat", "cmp", "comm", "cut", "diff", "dirname", "du", "echo",
+	"egrep", "false", "fgrep", "file", "grep", "head", "ls", "md5sum", "nl",
+	"od", "paste", "printf", "readlink", "realpath", "sha1sum", "sha256sum",
+	"sleep", "stat", "tail", "test", "true", "wc",
+};
+
+/* Jobs running at the same time, 0 when disabled. */
+static long workers;
+
+/**
+ * Run ; sequences as dataflow graphs.
+ */
+int autopar_enable(const char *value)
+{
+	char *end;
+	long count;
+
+	if (value == NULL || *value == '\0') {
+		count = sysconf(_SC_NPROCESSORS_ONLN);
+		workers = count > 0 ? count : 1;
+		return 0;
+	}
+
+	errno = 0;
+	count = strtol(value, &end, 10);
+	if (errno != 0 || *end != '\0' || count < 1) {
+		fprintf(stderr, "autopar: %s: invalid number of workers\n", value);
+		return -1;
+	}
+
+	workers = count;
+	return 0;
+}
+
+/**
+ * Run ; sequences in order again.
+ */
+void autopar_disable(void)
+{
+	workers = 0;
+}
+
+/**
+ * Check if ; sequences are run as dataflow graphs.
+ */
+bool autopar_enabled(void)
+{
+	return workers > 0;
+}
+
+/**
+ * Append the commands of a ; sequence to the jobs, in order.
+ */
+static void add_jobs(struct graph *g, command_t *c, command_t *father)
+{
+	if (c->op == OP_SEQUENTIAL) {
+		add_jobs(g, c->cmd1, c);
+		add_jobs(g, c->cmd2, c);
+		return;
+	}
+
+	if (g->job_count == g->job_size) {
+		g->job_size = g->job_size ? 2 * g->job_size : 16;
+		g->jobs = realloc(g->jobs, g->job_size * sizeof(*g->jobs));
+		DIE(g->jobs == NULL, "realloc");
+	}
+
+	g->jobs[g->job_count++] = (struct job) { .cmd = c, .father = father };
+}
+
+/**
+ * Check if a command changes the state of the shell, so that it has to run
+ * in the shell, alone.
+ */
+static bool changes_shell(command_t *c)
+{
+	char *verb;
+	bool ret;
+
+	// A subshell runs in a child whatever it does
+	if (c->op == OP_SUBSHELL)
+		return false;
+	if (c->op == OP_BRACE_GROUP)
+		return changes_shell(c->cmd1);
+	if (c->op != OP_NONE)
+		return changes_shell(c->cmd1) || changes_shell(c->cmd2);
+
+	verb = get_word(c->scmd->verb);
+	ret = strchr(verb, '=') != NULL;
+	for (size_t i = 0; !ret && i < sizeof(shell_commands) / sizeof(shell_commands[0]); i++)
+		ret = strcmp(verb, shell_commands[i]) == 0;
+	free(verb);
+
+	return ret;
+}
+
+/**
+ * Absolute path of name against the working directory, with its "." and
+ * ".." components and repeated slashes removed without looking at the file
+ * system.
+ */
+static char *normalize(const char *name)
+{
+	char *cwd = name[0] == '/' ? NULL : getcwd(NULL, 0), *full, *path;
+	char *part, *save;
+	size_t size, len = 0;
+
+	if (name[0] != '/' && cwd == NULL) {
+		path = strdup(name);
+		DIE(path == NULL, "strdup");
+		return path;
+	}
+
+	size = (cwd != NULL ? strlen(cwd) : 0) + strlen(name) + 2;
+	full = malloc(size);
+	path = malloc(size);
+	DIE(full == NULL || path == NULL, "malloc");
+	snprintf(full, size, "%s/%s", cwd != NULL ? cwd : "", name);
+	free(cwd);
+
+	for (part = strtok_r(full, "/", &save); part != NULL;
+		 part = strtok_r(NULL, "/", &save)) {
+		if (strcmp(part, ".") == 0)
+			continue;
+		if (strcmp(part, "..") == 0) {
+			while (len > 0 && path[--len] != '/')
+				;
+			continue;
+		}
+		len += sprintf(path + len, "/%s", part);
+	}
+	if (len == 0)
+		path[len++] = '/';
+	path[len] = '\0';
+	free(full);
+
+	return path;
+}
+
+/**
+ * Absolute path of a file that may not exist yet, so that different names
+ * of the same file are recognised.
+ */
+static char *resolve(const char *name)
+{
+	const char *slash = strrchr(name, '/');
+	char *path = realpath(name, NULL), *dir;
+
+	if (path != NULL)
+		return path;
+
+	// The file is not there yet, its directory may be
+	dir = slash == NULL ? strdup(".") :
+		  strndup(name, slash == name ? 1 : slash - name);
+	DIE(dir == NULL, "strdup");
+	path = realpath(dir, NULL);
+	free(dir);
+	if (path == NULL)
+		return normalize(name);
+
+	dir = path;
+	path = malloc(strlen(dir) + strlen(name) + 2);
+	DIE(path == NULL, "malloc");
+	sprintf(path, "%s/%s", strcmp(dir, "/") == 0 ? "" : dir,
+			slash == NULL ? name : slash + 1);
+	free(dir);
+
+	return path;
+}
+
+/**
+ * Record a file a job touches; path is taken over.
+ */
+static void add_access(struct graph *g, size_t job, char *path, bool write)
+{
+	if (g->access_count == g->access_size) {
+		g->access_size = g->access_size ? 2 * g->access_size : 16;
+		g->accesses = realloc(g->accesses,
+							  g->access_size * sizeof(*g->accesses));
+		DIE(g->accesses == NULL, "realloc");
+	}
+
+	g->accesses[g->access_count++] = (struct access) {
+		.path = path,
+		.job = job,
+		.write = write,
+	};
+}
+
+/**
+ * Record a file a job touches, and a read of every directory above it: a
+ * job creating, moving or removing one of them (mkdir d, then d/x) has to
+ * come first.
+ */
+static void add_file(struct graph *g, size_t job, const char *name,
+					 bool write)
+{
+	char *path = resolve(name), *dir;
+
+	for (char *slash = strchr(path + 1, '/'); slash != NULL;
+		 slash = strchr(slash + 1, '/')) {
+		dir = strndup(path, slash - path);
+		DIE(dir == NULL, "strndup");
+		add_access(g, job, dir, false);
+	}
+	add_access(g, job, path, write);
+}
+
+/**
+ * Record the files of a list of words (redirections).
+ */
+static void add_words(struct graph *g, size_t job, word_t *w, bool write)
+{
+	for (; w != NULL; w = w->next_word) {
+		char *name = get_word(w);
+
+		add_file(g, job, name, write);
+		free(name);
+	}
+}
+
+/**
+ * Check if a command only reads the files its operands name.
+ */
+static bool only_reads(simple_command_t *s)
+{
+	char *verb = get_word(s->verb), *slash = strrchr(verb, '/');
+	const char *name = slash != NULL ? slash + 1 : verb;
+	bool ret = false;
+
+	for (size_t i = 0; !ret && i < sizeof(reading_commands) / sizeof(reading_commands[0]); i++)
+		ret = strcmp(name, reading_commands[i]) == 0;
+	free(verb);
+
+	return ret;
+}
+
+/**
+ * Record the files the parameters of a command name. The operands of a
+ * command that may write them are recorded as written, and so are the
+ * values attached to its options (-ofile, --output=file).
+ */
+static void add_operands(struct graph *g, size_t job, simple_command_t *s)
+{
+	bool write = !only_reads(s);
+
+	for (word_t *w = s->params; w != NULL; w = w->next_word) {
+		char *name = get_word(w), *value = NULL;
+
+		if (name[0] != '-')
+			value = name;
+		else if (write && name[1] == '-')
+			value = strchr(name, '=') != NULL ? strchr(name, '=') + 1 : NULL;
+		else if (write && name[1] != '\0' && name[2] != '\0')
+			value = name + 2;
+
+		if (value != NULL && *value != '\0')
+			add_file(g, job, value, write);
+		free(name);
+	}
+}
+
+/**
+ * Apply the duplications of a command entered before (or after) its file
+ * redirections to where its descriptors point.
+ */
+static void follow_dups(dup_t *d, bool before_files, int *targets)
+{
+	for (; d != NULL; d = d->next) {
+		if (d->before_files != before_files ||
+			d->fd < 0 || d->fd >= SHELL_FD_MIN)
+			continue;
+
+		targets[d->fd] = d->source >= 0 && d->source < SHELL_FD_MIN ?
+						 targets[d->source] : TO_OTHER;
+	}
+}
+
+/**
+ * Follow the redirections of a command, in the order the shell applies
+ * them, from where its descriptors point (TO_STDOUT, TO_STDERR or TO_OTHER
+ * for the others, files and pipes) to where they end up, and record the
+ * files they open.
+ */
+static void follow_redirections(struct graph *g, size_t job,
+								simple_command_t *s, int *targets)
+{
+	follow_dups(s->dup, true, targets);
+	add_words(g, job, s->in, false);
+	add_words(g, job, s->out, true);
+	add_words(g, job, s->err, true);
+	if (s->in != NULL)
+		targets[STDIN_FILENO] = TO_OTHER;
+	if (s->out != NULL)
+		targets[STDOUT_FILENO] = TO_OTHER;
+	if (s->err != NULL)
+		targets[STDERR_FILENO] = TO_OTHER;
+	follow_dups(s->dup, false, targets);
+}
+
+/**
+ * Record a write of the shell's stdout or stderr, for a job that has a
+ * descriptor (other than stdin) pointing there.
+ */
+static void add_outputs(struct graph *g, size_t job, const int *targets)
+{
+	bool out = false, err = false;
+	char *path;
+
+	for (int fd = STDOUT_FILENO; fd < SHELL_FD_MIN; fd++) {
+		out = out || targets[fd] == TO_STDOUT;
+		err = err || targets[fd] == TO_STDERR;
+	}
+
+	if (out) {
+		path = strdup(STDOUT_RESOURCE);
+		DIE(path == NULL, "strdup");
+		add_access(g, job, path, true);
+	}
+	if (err) {
+		path = strdup(STDERR_RESOURCE);
+		DIE(path == NULL, "strdup");
+		add_access(g, job, path, true);
+	}
+}
+
+/**
+ * Record the files a job touches: its redirections, the files its
+ * parameters name and the shell's stdout and stderr, for the descriptors
+ * (given by targets, indexed by descriptor) that still point there.
+ */
+static void collect_accesses(struct graph *g, size_t job, command_t *c,
+							 const int *parent_targets)
+{
+	int targets[SHELL_FD_MIN];
+
+	memcpy(targets, parent_targets, sizeof(targets));
+
+	// The redirections of a group apply to all of its commands
+	if (c->op == OP_BRACE_GROUP || c->op == OP_SUBSHELL) {
+		follow_redirections(g, job, c->scmd, targets);
+		collect_accesses(g, job, c->cmd1, targets);
+		return;
+	}
+
+	if (c->op != OP_NONE) {
+		int left[SHELL_FD_MIN];
+
+		// Of a fan-out chain, only the leftmost command writes to a pipe
+		memcpy(left, targets, sizeof(left));
+		if (c->op == OP_PIPE ||
+			(c->op == OP_FANOUT && c->cmd1->op != OP_FANOUT))
+			left[STDOUT_FILENO] = TO_OTHER;
+		collect_accesses(g, job, c->cmd1, left);
+		collect_accesses(g, job, c->cmd2, targets);
+		return;
+	}
+
+	follow_redirections(g, job, c->scmd, targets);
+	add_operands(g, job, c->scmd);
+	add_outputs(g, job, targets);
+}
+
+/**
+ * Order the accesses by file, then by job.
+ */
+static int compare_accesses(const void *a, const void *b)
+{
+	const struct access *x = a, *y = b;
+	int ret = strcmp(x->path, y->path);
+
+	if (ret != 0)
+		return ret;
+
+	return x->job < y->job ? -1 : x->job > y->job;
+}
+
+/**
+ * Make job to wait for job from.
+ */
+static void add_edge(struct graph *g, size_t from, size_t to)
+{
+	struct job *j = &g->jobs[from];
+
+	if (from == to)
+		return;
+
+	if (j->dependent_count == j->dependent_size) {
+		j->dependent_size = j->dependent_size ? 2 * j->dependent_size : 4;
+		j->dependents = realloc(j->dependents,
+								j->dependent_size * sizeof(*j->dependents));
+		DIE(j->dependents == NULL, "realloc");
+	}
+
+	j->dependents[j->dependent_count++] = to;
+	g->jobs[to].waiting++;
+}
+
+/**
+ * Make every job wait for the earlier jobs touching the same files, unless
+ * they all only read them: a writer waits for the previous writer and the
+ * readers since, a reader only for the previous writer.
+ */
+static void link_jobs(struct graph *g)
+{
+	size_t start, i, k;
+
+	qsort(g->accesses, g->access_count, sizeof(*g->accesses),
+		  compare_accesses);
+
+	for (start = 0; start < g->access_count; start = i) {
+		size_t writer = 0, readers = start;
+		bool written = false;
+
+		for (i = start; i < g->access_count &&
+			 strcmp(g->accesses[i].path, g->accesses[start].path) == 0; i++) {
+			struct access *a = &g->accesses[i];
+
+			if (written)
+				add_edge(g, g->accesses[writer].job, a->job);
+			if (!a->write)
+				continue;
+
+			for (k = readers; k < i; k++)
+				add_edge(g, g->accesses[k].job, a->job);
+			writer = i;
+			written = true;
+			readers = i + 1;
+		}
+	}
+}
+
+/**
+ * Forget the files and the links of the jobs that were run.
+ */
+static void clear_accesses(struct graph *g, size_t first, size_t last)
+{
+	for (size_t i = 0; i < g->access_count; i++)
+		free(g->accesses[i].path);
+	g->access_count = 0;
+
+	for (size_t i = first; i < last; i++) {
+		free(g->jobs[i].dependents);
+		g->jobs[i].dependents = NULL;
+		g->jobs[i].dependent_count = g->jobs[i].dependent_size = 0;
+	}
+}
+
+/**
+ * Mark a job as done and queue the jobs that no longer wait for anything.
+ */
+static void finish_job(struct graph *g, size_t job, int status,
+					   size_t *queue, size_t *tail)
+{
+	struct job *j = &g->jobs[job];
+
+	j->status = status;
+	j->pid = 0;
+	for (size_t i = 0; i < j->dependent_count; i++)
+		if (--g->jobs[j->dependents[i]].waiting == 0)
+			queue[(*tail)++] = j->dependents[i];
+}
+
+/**
+ * Run the jobs from first to last (excluded), each one in a child as soon
+ * as the jobs it waits for are done, at most workers at a time.
+ */
+static void run_jobs(struct graph *g, size_t first, size_t last, int level,
+					 autopar_spawn_t spawn, autopar_run_t run)
+{
+	size_t count = last - first, done = 0, running = 0, head = 0, tail = 0;
+	size_t slot_count = count < (size_t)workers ? count : (size_t)workers;
+	size_t *queue = malloc(count * sizeof(*queue));
+	size_t *slots = malloc(slot_count * sizeof(*slots));
+	size_t i;
+	int status;
+	pid_t pid;
+
+	DIE(queue == NULL || slots == NULL, "malloc");
+
+	for (i = first; i < last; i++)
+		if (g->jobs[i].waiting == 0)
+			queue[tail++] = i;
+
+	while (done < count) {
+		// Start the ready jobs, in the order of the sequence
+		while (running < slot_count && head < tail) {
+			struct job *j = &g->jobs[queue[head]];
+
+			j->pid = spawn(j->cmd, level, j->father);
+			if (j->pid == -1 && running > 0)
+				break;
+
+			head++;
+			if (j->pid == -1) {
+				// Not even one child, the shell runs it itself
+				finish_job(g, j - g->jobs, run(j->cmd, level, j->father),
+						   queue, &tail);
+				done++;
+				continue;
+			}
+			slots[running++] = j - g->jobs;
+		}
+
+		if (running == 0)
+			break;
+
+		pid = wait_child(-1, &status);
+		if (pid == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("wait");
+			break;
+		}
+
+		for (i = 0; i < running && g->jobs[slots[i]].pid != pid; i++)
+			;
+		if (i == running)
+			continue;
+
+		finish_job(g, slots[i], WEXITSTATUS(status), queue, &tail);
+		slots[i] = slots[--running];
+		done++;
+	}
+
+	free(slots);
+	free(queue);
+}
+
+/**
+ * Run the ; sequence rooted at c, returns the status of its last command.
+ */
+int autopar_run(command_t *c, int level, autopar_spawn_t spawn,
+				autopar_run_t run)
+{
+	struct graph g = { 0 };
+	int targets[SHELL_FD_MIN] = { [STDOUT_FILENO] = TO_STDOUT,
+								  [STDERR_FILENO] = TO_STDERR };
+	size_t first = 0, last, i;
+	int exit_status = 0;
+
+	add_jobs(&g, c, NULL);
+
+	while (first < g.job_count) {
+		// Jobs up to the next one changing the shell, looked at only now,
+		// once the previous one has run
+		for (last = first; last < g.job_count; last++)
+			if (changes_shell(g.jobs[last].cmd))
+				break;
+
+		if (last > first) {
+			for (i = first; i < last; i++)
+				collect_accesses(&g, i, g.jobs[i].cmd, targets);
+			link_jobs(&g);
+			run_jobs(&g, first, last, level, spawn, run);
+			clear_accesses(&g, first, last);
+			exit_status = g.jobs[last - 1].status;
+		}
+
+		if (last < g.job_count) {
+			exit_status = run(g.jobs[last].cmd, level, g.jobs[last].father);
+			if (exit_status == SHELL_EXIT)
+				break;
+		}
+		first = last + 1;
+	}
+
+	free(g.accesses);
+	free(g.jobs);
+
+	return exit_status;
+}
@@ -0,0 +1,44 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef _AUTOPAR_H
+#define _AUTOPAR_H
+
+#include <sys/types.h>
+
+#include "../util/parser/parser.h"
+
+/* Start a command in a child process, returns its pid or -1. */
+typedef pid_t (*autopar_spawn_t)(command_t *c, int level, command_t *father);
+
+/* Run a command in the shell itself, returns its exit status. */
+typedef int (*autopar_run_t)(command_t *c, int level, command_t *father);
+
+/**
+ * Run ; sequences as dataflow graphs (set -o autopar[=workers]), with at
+ * most workers commands at a time (default: the number of online CPUs).
+ * Returns 0 on success and -1 on an invalid number of workers.
+ */
+int autopar_enable(const char *value);
+
+/**
+ * Run ; sequences in order again (set +o autopar).
+ */
+void autopar_disable(void);
+
+/**
+ * Check if ; sequences are run as dataflow graphs.
+ */
+bool autopar_enabled(void);
+
+/**
+ * Run the ; sequence rooted at c. Its commands start as soon as every
+ * earlier command touching the same files (or the shell's stdout or
+ * stderr) has finished; commands that change the state of the shell (cd,
+ * set, assignments, ...) run in the shell, after everything before them
+ * and before everything after them.
+ * Returns the exit status of the last command, like the sequence would.
+ */
+int autopar_run(command_t *c, int level, autopar_spawn_t spawn,
+				autopar_run_t run);
+
+#endif /* _AUTOPAR_H */
@@ -1,18 +1,56 @@
 // SPDX-License-Identifier: BSD-3-Clause
 
+#define _GNU_SOURCE
+
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
+#include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
+#include "autopar.h"
 #include "cmd.h"
+#include "copy.h"
+#include "fdaudit.h"
+#include "incremental.h"
+#include "memo.h"
+#include "stats.h"
+#include "timing.h"
+#include "trace.h"
+#include "uring.h"
 #include "utils.h"
+#include "zygote.h"
 
 #define READ 0
 #define WRITE 1
 
+// exit status of the last command run, which exit reports
+static int last_status;
+
+// children copying to the files of multiple redirections (cmd > a > b), and
+// the nesting of saved descriptors they were started at
+static struct multios {
+	pid_t pid;
+	int depth;
+} *multios;
+static int multios_count, multios_capacity, redirect_depth;
+
+// descriptors above stderr replaced by a duplication (3>&1), with a saved
+// copy of what they were (-1 if closed) and the nesting they are put back at
+static struct user_fd {
+	int fd;
+	int saved;
+	int depth;
+} *user_fds;
+static int user_fd_count, user_fd_capacity;
+
 int printf(const char *format, ...);
 char *strtok_r(char *str, const char *delim, char **saveptr);
 int strcmp(const char *str1, const char *str2);
@@ -61,9 +99,415 @@ static bool shell_cd(word_t *dir)
 }
 
 /**
- * Internal exit/quit command.
+ * Options that can be toggled with set -o name[=value] / set +o name.
+ */
+static const struct shell_option {
+	const char *name;
+	int (*enable)(const char *value);
+	void (*disable)(void);
+} shell_options[] = {
+	{ "trace", trace_open, trace_close },
+	{ "uring", uring_enable, uring_disable },
+	{ "fdaudit", fdaudit_enable, fdaudit_disable },
+	{ "autopar", autopar_enable, autopar_disable },
+	{ "incremental", incremental_enable, incremental_disable },
+};
+
+/**
+ * Internal set command.
+ */
+static bool shell_set(word_t *params)
+{
+	bool ret = true;
+
+	for (; params != NULL; params = params->next_word) {
+		char *arg = get_word(params);
+		bool enable = strcmp(arg, "-o") == 0;
+		char *name, *value;
+		size_t i;
+
+		// Options are given as -o name or +o name
+		if ((!enable && strcmp(arg, "+o") != 0) || params->next_word == NULL) {
+			fprintf(stderr, "set: usage: set [-o name[=value]] [+o name]\n");
+			free(arg);
+			return false;
+		}
+		free(arg);
+
+		params = params->next_word;
+		name = get_word(params);
+		value = strchr(name, '=');
+		if (value != NULL)
+			*value++ = '\0';
+
+		for (i = 0; i < sizeof(shell_options) / sizeof(shell_options[0]); i++)
+			if (strcmp(name, shell_options[i].name) == 0)
+				break;
+
+		if (i == sizeof(shell_options) / sizeof(shell_options[0])) {
+			fprintf(stderr, "set: %s: invalid option name\n", name);
+			ret = false;
+		} else if (enable) {
+			if (shell_options[i].enable(value) != 0)
+				ret = false;
+		} else {
+			shell_options[i].disable();
+		}
+		free(name);
+	}
+
+	return ret;
+}
+
+/**
+ * Internal shellstats command, prints (or with -r resets) the latency
+ * histograms of the shell's own phases.
+ */
+static bool shell_stats(word_t *params)
+{
+	char *arg = get_word(params);
+	bool ret = true;
+
+	if (arg == NULL) {
+		stats_print();
+	} else if (strcmp(arg, "-r") == 0 && params->next_word == NULL) {
+		stats_reset();
+	} else {
+		fprintf(stderr, "shellstats: usage: shellstats [-r]\n");
+		ret = false;
+	}
+
+	free(arg);
+	return ret;
+}
+
+/**
+ * Expand the backslash escapes of echo -e in place and return the new
+ * length of the string; stop is set when \c ends the output.
+ */
+static size_t echo_unescape(char *str, bool *stop)
+{
+	char *out = str;
+
+	for (char *in = str; *in != '\0'; in++) {
+		int value = 0, digits = 0;
+
+		if (*in != '\\' || in[1] == '\0') {
+			*out++ = *in;
+			continue;
+		}
+
+		switch (*++in) {
+		case 'a': *out++ = '\a'; break;
+		case 'b': *out++ = '\b'; break;
+		case 'e': *out++ = '\033'; break;
+		case 'f': *out++ = '\f'; break;
+		case 'n': *out++ = '\n'; break;
+		case 'r': *out++ = '\r'; break;
+		case 't': *out++ = '\t'; break;
+		case 'v': *out++ = '\v'; break;
+		case '\\': *out++ = '\\'; break;
+		case 'c':
+			*stop = true;
+			return out - str;
+
+		// \0nnn, up to three octal digits
+		case '0':
+			for (; digits < 3 && in[1] >= '0' && in[1] <= '7'; digits++)
+				value = value * 8 + *++in - '0';
+			*out++ = value;
+			break;
+
+		// \xHH, up to two hexadecimal digits
+		case 'x':
+			for (; digits < 2 && isxdigit((unsigned char)in[1]); digits++) {
+				in++;
+				value = value * 16 + (isdigit((unsigned char)*in) ?
+						*in - '0' : tolower((unsigned char)*in) - 'a' + 10);
+			}
+			if (digits == 0) {
+				*out++ = '\\';
+				*out++ = 'x';
+			} else {
+				*out++ = value;
+			}
+			break;
+
+		default:
+			*out++ = '\\';
+			*out++ = *in;
+			break;
+		}
+	}
+
+	return out - str;
+}
+
+/**
+ * Internal echo command, with the -n, -e and -E options of bash's echo.
+ * The line is written with a single write(), like /bin/echo would.
+ */
+static bool shell_echo(char **argv)
+{
+	bool newline = true, escapes = false, stop = false, ret;
+	size_t len = 0;
+	char *buffer;
+	int i, j;
+
+	// Leading words made only of option letters are options
+	for (i = 1; argv[i] != NULL && argv[i][0] == '-' && argv[i][1] != '\0' &&
+		 argv[i][1 + strspn(argv[i] + 1, "neE")] == '\0'; i++)
+		for (char *opt = argv[i] + 1; *opt != '\0'; opt++)
+			if (*opt == 'n')
+				newline = false;
+			else
+				escapes = *opt == 'e';
+
+	for (j = i; argv[j] != NULL; j++)
+		len += strlen(argv[j]) + 1;
+	buffer = malloc(len + 1);
+	DIE(buffer == NULL, "malloc");
+
+	len = 0;
+	for (; argv[i] != NULL && !stop; i++) {
+		size_t n = strlen(argv[i]);
+
+		memcpy(buffer + len, argv[i], n + 1);
+		if (escapes)
+			n = echo_unescape(buffer + len, &stop);
+		len += n;
+		if (argv[i + 1] != NULL && !stop)
+			buffer[len++] = ' ';
+	}
+	if (newline && !stop)
+		buffer[len++] = '\n';
+
+	fflush(stdout);
+	ret = write_all(STDOUT_FILENO, buffer, len) == (ssize_t)len;
+	// A reader that went away is not worth a message
+	if (!ret && errno != EPIPE)
+		perror("echo: write error");
+
+	free(buffer);
+	return ret;
+}
+
+/**
+ * Internal commands that do not change the state of the shell, so they can
+ * run inside it even as stages of pipes and parallel commands.
+ */
+static const char * const pure_builtins[] = { "echo", "true", "false" };
+
+/**
+ * Check if a command is a pure internal command.
+ */
+static bool is_pure_builtin(const char *command)
+{
+	for (size_t i = 0; i < sizeof(pure_builtins) / sizeof(pure_builtins[0]); i++)
+		if (strcmp(command, pure_builtins[i]) == 0)
+			return true;
+
+	return false;
+}
+
+/**
+ * Run a pure internal command.
+ */
+static int shell_pure(char **argv)
+{
+	if (strcmp(argv[0], "echo") == 0)
+		return shell_echo(argv) ? 0 : 1;
+
+	return strcmp(argv[0], "false") == 0;
+}
+
+/**
+ * Copy one operand of cat ("-" is stdin) to stdout.
+ */
+static int cat_file(const char *name, struct stat *out)
+{
+	bool is_stdin = strcmp(name, "-") == 0;
+	int fd = is_stdin ? STDIN_FILENO : open(name, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	int ret = 0;
+
+	if (fd == -1) {
+		fprintf(stderr, "cat: %s: %s\n", name, strerror(errno));
+		return 1;
+	}
+
+	// Like GNU cat, refuse to read a file it is appending to
+	if (out != NULL && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+		st.st_dev == out->st_dev && st.st_ino == out->st_ino &&
+		lseek(fd, 0, SEEK_CUR) < st.st_size) {
+		fprintf(stderr, "cat: %s: input file is output file\n", name);
+		ret = 1;
+	} else if (copy_fd(fd, STDOUT_FILENO) != 0) {
+		if (errno != EPIPE)
+			fprintf(stderr, "cat: %s: %s\n", name, strerror(errno));
+		ret = 1;
+	}
+
+	if (!is_stdin)
+		close(fd);
+	return ret;
+}
+
+/**
+ * Internal cat command, for cat [file...] without options.
+ * Returns -1 when the arguments need the external command.
+ */
+static int shell_cat(char **argv)
+{
+	struct stat out;
+	bool out_file;
+	int ret = 0;
+
+	for (int i = 1; argv[i] != NULL; i++)
+		if (argv[i][0] == '-' && argv[i][1] != '\0')
+			return -1;
+
+	out_file = fstat(STDOUT_FILENO, &out) == 0 && S_ISREG(out.st_mode);
+	if (argv[1] == NULL)
+		return cat_file("-", out_file ? &out : NULL);
+
+	for (int i = 1; argv[i] != NULL; i++)
+		ret |= cat_file(argv[i], out_file ? &out : NULL);
+
+	return ret;
+}
+
+/**
+ * Internal tee command, for tee [-a] [file...].
+ * Returns -1 when the arguments need the external command.
+ */
+static int shell_tee(char **argv)
+{
+	int i = 1, count = 1, ret = 0, flags = O_WRONLY | O_CREAT | O_CLOEXEC;
+	int *outs;
+
+	if (argv[1] != NULL && strcmp(argv[1], "-a") == 0)
+		i++;
+	flags |= i > 1 ? O_APPEND : O_TRUNC;
+
+	for (int j = i; argv[j] != NULL; j++)
+		if (argv[j][0] == '-' && argv[j][1] != '\0')
+			return -1;
+
+	for (int j = i; argv[j] != NULL; j++)
+		count++;
+	outs = malloc(count * sizeof(*outs));
+	DIE(outs == NULL, "malloc");
+
+	outs[0] = STDOUT_FILENO;
+	count = 1;
+	for (; argv[i] != NULL; i++) {
+		int fd = open(argv[i], flags, 0666);
+
+		if (fd == -1) {
+			fprintf(stderr, "tee: %s: %s\n", argv[i], strerror(errno));
+			ret = 1;
+			continue;
+		}
+		outs[count++] = fd;
+	}
+
+	if (tee_fds(STDIN_FILENO, outs, count) != 0) {
+		if (errno != EPIPE)
+			perror("tee");
+		ret = 1;
+	}
+
+	for (i = 1; i < count; i++)
+		if (outs[i] >= 0)
+			close(outs[i]);
+	free(outs);
+
+	return ret;
+}
+
+/**
+ * Run cat or tee inside the shell, with data moved by the kernel whenever
+ * the descriptors allow it. Returns -1 if the command is not one of them
+ * or needs the external command.
+ */
+static int shell_copy(char **argv)
+{
+	struct sigaction ignore = { .sa_handler = SIG_IGN }, saved_action;
+	int ret;
+
+	if (strcmp(argv[0], "cat") != 0 && strcmp(argv[0], "tee") != 0)
+		return -1;
+
+	// A reader going away must not kill the shell
+	fflush(stdout);
+	sigaction(SIGPIPE, &ignore, &saved_action);
+	ret = strcmp(argv[0], "cat") == 0 ? shell_cat(argv) : shell_tee(argv);
+	sigaction(SIGPIPE, &saved_action, NULL);
+
+	return ret;
+}
+
+/**
+ * Terminate a forked child. exit() would also sync the offset of the stdin
+ * stream shared with the shell, which then reads its commands again when
+ * they come from a regular file, so only the output streams are flushed.
+ */
+static void __attribute__((noreturn)) exit_child(int status)
+{
+	fflush(stdout);
+	fflush(stderr);
+	_exit(status);
+}
+
+/**
+ * Internal exit/quit command: unwind to the caller, which then terminates
+ * the shell (or only the forked child running it, e.g. a subshell).
  */
-static int shell_exit(void) { exit(SHELL_EXIT); }
+static int shell_exit(void)
+{
+	return SHELL_EXIT;
+}
+
+/**
+ * Map the status returned by parse_command() to the exit status of the
+ * shell: exit terminates it with the status of the last command.
+ */
+int shell_exit_status(int status)
+{
+	return status == SHELL_EXIT ? last_status : status;
+}
+
+/**
+ * Replace the current (forked) process with an external command.
+ */
+static void __attribute__((noreturn)) exec_command(char **argv)
+{
+	fdaudit_check(argv);
+	execvp(argv[0], argv);
+	printf("Execution failed for '%s'\n", argv[0]);
+	exit_child(127);
+}
+
+/**
+ * Check if a simple command is handled by the shell itself (internal
+ * command, time keyword or environment variable assignment).
+ */
+static bool is_builtin(simple_command_t *s)
+{
+	static const char * const builtins[] = {
+		"exit", "quit", "cd", "set", "shellstats", "time", "cat", "tee",
+		"memo",
+	};
+	char *command = get_word(s->verb);
+	bool ret = strchr(command, '=') != NULL || is_pure_builtin(command);
+
+	for (size_t i = 0; !ret && i < sizeof(builtins) / sizeof(builtins[0]); i++)
+		ret = strcmp(command, builtins[i]) == 0;
+
+	free(command);
+	return ret;
+}
 
 /**
  * Duplicate file descriptor
@@ -78,15 +522,42 @@ static int dup_fd(int fd, int descriptor)
 	return 0;
 }
 
+/**
+ * Open a redirection file, unless it was opened in advance for its group.
+ * The file is kept above the standard descriptors: one of them closed by a
+ * duplication (cmd >&- > f) would be reused, then closed after the dup2().
+ */
+static int open_file(word_t *w, const char *filename, int flags)
+{
+	int fd, moved;
+
+	if (uring_take(w, &fd)) {
+		if (fd < 0) {
+			errno = -fd;
+			return -1;
+		}
+	} else {
+		fd = open(filename, flags | O_CLOEXEC, 0644);
+	}
+
+	if (fd < 0 || fd > STDERR_FILENO)
+		return fd;
+
+	moved = fcntl(fd, F_DUPFD_CLOEXEC, STDERR_FILENO + 1);
+	close(fd);
+	return moved;
+}
+
 /**
  *  Redirects a file descriptor to a file
  */
-static int redirect(const char *filename, int descriptor, int append)
+static int redirect(word_t *w, const char *filename, int descriptor,
+					int append)
 {
 	int fd;
 	// Redirect input from file
 	if (descriptor == STDIN_FILENO) {
-		fd = open(filename, O_RDONLY);
+		fd = open_file(w, filename, O_RDONLY);
 
 		if (fd == -1) {
 			perror("open");
@@ -105,7 +576,7 @@ static int redirect(const char *filename, int descriptor, int append)
 			flags |= O_TRUNC;
 
 		// Open file
-		fd = open(filename, flags, 0644);
+		fd = open_file(w, filename, flags);
 
 		if (fd == -1) {
 			perror("open");
@@ -124,18 +595,184 @@ static int redirect(const char *filename, int descriptor, int append)
 	return 0;
 }
 
+/**
+ * Redirect stdout and/or stderr (given by descriptor, as for redirect()) to
+ * every file of a list of several, like zsh: a child copies what is written
+ * to a pipe into all of them with tee() and splice(). The child is waited
+ * for by restore_file_descriptors().
+ */
+static int redirect_all(word_t *list, int descriptor, int append)
+{
+	int flags = O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC);
+	int end = -1, count = 0, ret = 0, *outs;
+	pid_t pid = -1;
+
+	for (word_t *w = list; w != NULL; w = w->next_word)
+		count++;
+	outs = malloc(count * sizeof(*outs));
+	DIE(outs == NULL, "malloc");
+
+	count = 0;
+	for (word_t *w = list; ret == 0 && w != NULL; w = w->next_word) {
+		char *filename = get_word(w);
+
+		outs[count] = open_file(w, filename, flags);
+		if (outs[count] == -1) {
+			perror("open");
+			ret = -1;
+		} else {
+			count++;
+		}
+		free(filename);
+	}
+
+	if (ret == 0) {
+		end = start_tee(outs, count, &pid);
+		if (end == -1) {
+			perror("tee");
+			ret = -1;
+		}
+	}
+
+	for (int i = 0; i < count; i++)
+		close(outs[i]);
+	free(outs);
+	if (ret == -1)
+		return -1;
+
+	if (multios_count == multios_capacity) {
+		multios_capacity = multios_capacity ? 2 * multios_capacity : 4;
+		multios = realloc(multios, multios_capacity * sizeof(*multios));
+		DIE(multios == NULL, "realloc");
+	}
+	multios[multios_count].pid = pid;
+	multios[multios_count++].depth = redirect_depth;
+
+	if (descriptor & STDOUT_FILENO)
+		dup_fd(end, STDOUT_FILENO);
+	if (descriptor & STDERR_FILENO)
+		dup_fd(end, STDERR_FILENO);
+	close(end);
+	return 0;
+}
+
+/**
+ * Check if a command duplicates onto a descriptor above stderr, which the
+ * spawn server cannot hand to the command it starts.
+ */
+static bool has_user_fds(simple_command_t *s)
+{
+	for (dup_t *d = s->dup; d != NULL; d = d->next)
+		if (d->fd > STDERR_FILENO)
+			return true;
+
+	return false;
+}
+
+/**
+ * Check if a command has multiple output or error redirections.
+ */
+static bool has_multios(simple_command_t *s)
+{
+	return (s->out != NULL && s->out->next_word != NULL) ||
+		   (s->err != NULL && s->err->next_word != NULL);
+}
+
+/**
+ * Duplicate a descriptor for the shell's own use: close-on-exec, so no
+ * external command inherits it, and above the descriptors users redirect.
+ */
+static int save_fd(int fd)
+{
+	return fcntl(fd, F_DUPFD_CLOEXEC, SHELL_FD_MIN);
+}
+
+/**
+ * Save a descriptor above stderr before a duplication replaces it, for
+ * restore_file_descriptors() to put it back.
+ * Returns 0 on success and -1 on error.
+ */
+static int save_user_fd(int fd)
+{
+	int saved = -1;
+
+	if (fcntl(fd, F_GETFD) != -1) {
+		saved = save_fd(fd);
+		if (saved == -1) {
+			perror("dup");
+			return -1;
+		}
+	}
+
+	if (user_fd_count == user_fd_capacity) {
+		user_fd_capacity = user_fd_capacity ? 2 * user_fd_capacity : 4;
+		user_fds = realloc(user_fds, user_fd_capacity * sizeof(*user_fds));
+		DIE(user_fds == NULL, "realloc");
+	}
+	user_fds[user_fd_count].fd = fd;
+	user_fds[user_fd_count].saved = saved;
+	user_fds[user_fd_count++].depth = redirect_depth;
+
+	return 0;
+}
+
+/**
+ * Make a descriptor a copy of one that is already open (N>&M), or close it
+ * (N>&-), without opening anything. One above stderr is saved first, and
+ * put back after the command like the standard ones. The shell's own
+ * descriptors (all of them close-on-exec) can be neither duplicated nor
+ * replaced.
+ */
+static int duplicate(dup_t *d)
+{
+	int flags = d->source == -1 ? 0 : fcntl(d->source, F_GETFD);
+	int target = d->fd > STDERR_FILENO ? fcntl(d->fd, F_GETFD) : 0;
+
+	if (flags == -1 || (flags & FD_CLOEXEC) ||
+		(target != -1 && (target & FD_CLOEXEC))) {
+		fprintf(stderr, "dup: %d: %s\n",
+				flags == -1 || (flags & FD_CLOEXEC) ? d->source : d->fd,
+				strerror(EBADF));
+		return -1;
+	}
+
+	if (d->fd > STDERR_FILENO && save_user_fd(d->fd) == -1)
+		return -1;
+
+	if (d->source == -1) {
+		close(d->fd);
+		return 0;
+	}
+
+	if (dup2(d->source, d->fd) == -1) {
+		perror("dup2");
+		return -1;
+	}
+	return 0;
+}
+
 /**
  * Apply redirections from a command
  */
 static int apply_redirections(simple_command_t *s)
 {
 	int exit_status = 0, descriptors = 0;
+	char *in;
+
+	// Duplications entered first copy the descriptors as they were, so
+	// that cmd 2>&1 > f leaves stderr where stdout was
+	for (dup_t *d = s->dup; exit_status == 0 && d != NULL; d = d->next)
+		if (d->before_files)
+			exit_status = duplicate(d);
+	if (exit_status == -1)
+		return exit_status;
+
 	// Get input file
-	char *in = get_word(s->in);
+	in = get_word(s->in);
 	// If input file is not null redirect input
 	if (in != NULL) {
 		descriptors = STDIN_FILENO;
-		exit_status = redirect(in, descriptors, 0);
+		exit_status = redirect(s->in, in, descriptors, 0);
 	}
 	free(in);
 	// Check if redirect failed
@@ -152,7 +789,10 @@ static int apply_redirections(simple_command_t *s)
 		if (out != NULL && err != NULL) {
 			descriptors = STDOUT_FILENO;
 			descriptors |= STDERR_FILENO;
-			exit_status = redirect(out, descriptors, 0);
+			if (s->out->next_word != NULL)
+				exit_status = redirect_all(s->out, descriptors, 0);
+			else
+				exit_status = redirect(s->out, out, descriptors, 0);
 		}
 
 		free(out);
@@ -166,9 +806,12 @@ static int apply_redirections(simple_command_t *s)
 			// Set flag for append if needed
 			int append = s->io_flags & IO_ERR_APPEND;
 
-			if (err != NULL) {
+			if (err != NULL && s->err->next_word != NULL) {
+				descriptors = STDERR_FILENO;
+				exit_status = redirect_all(s->err, descriptors, append);
+			} else if (err != NULL) {
 				descriptors = STDERR_FILENO;
-				exit_status = redirect(err, descriptors, append);
+				exit_status = redirect(s->err, err, descriptors, append);
 			}
 			free(err);
 		}
@@ -178,13 +821,22 @@ static int apply_redirections(simple_command_t *s)
 			// Set flag for append if needed
 			int append = s->io_flags & IO_OUT_APPEND;
 
-			if (out != NULL) {
+			if (out != NULL && s->out->next_word != NULL) {
 				descriptors = STDOUT_FILENO;
-				exit_status = redirect(out, descriptors, append);
+				exit_status = redirect_all(s->out, descriptors, append);
+			} else if (out != NULL) {
+				descriptors = STDOUT_FILENO;
+				exit_status = redirect(s->out, out, descriptors, append);
 			}
 			free(out);
 		}
 	}
+
+	// The others go last, so that cmd > f 2>&1 sends both to f
+	for (dup_t *d = s->dup; exit_status == 0 && d != NULL; d = d->next)
+		if (!d->before_files)
+			exit_status = duplicate(d);
+
 	return exit_status;
 }
 
@@ -195,9 +847,10 @@ static void duplicate_file_descriptors(int *original_stdin,
 									   int *original_stdout,
 									   int *original_stderr)
 {
-	*original_stdin = dup(STDIN_FILENO);
-	*original_stdout = dup(STDOUT_FILENO);
-	*original_stderr = dup(STDERR_FILENO);
+	*original_stdin = save_fd(STDIN_FILENO);
+	*original_stdout = save_fd(STDOUT_FILENO);
+	*original_stderr = save_fd(STDERR_FILENO);
+	redirect_depth++;
 
 	if (*original_stdin == -1 || *original_stdout == -1 ||
 		*original_stderr == -1) {
@@ -209,11 +862,28 @@ static void duplicate_file_descriptors(int *original_stdin,
 }
 
 /**
- * Restore file descriptors to their original values.
+ * Restore file descriptors to their original values (the standard ones and
+ * those replaced by a duplication), then wait for the tees of multiple
+ * redirections, which see the end of their input once no descriptor is left
+ * on their pipe.
  */
 static void restore_file_descriptors(int original_stdin, int original_stdout,
 									 int original_stderr)
 {
+	int status;
+
+	while (user_fd_count > 0 &&
+		   user_fds[user_fd_count - 1].depth == redirect_depth) {
+		struct user_fd *u = &user_fds[--user_fd_count];
+
+		if (u->saved == -1) {
+			close(u->fd);
+		} else {
+			dup2(u->saved, u->fd);
+			close(u->saved);
+		}
+	}
+
 	dup_fd(original_stdin, STDIN_FILENO);
 	dup_fd(original_stdout, STDOUT_FILENO);
 	dup_fd(original_stderr, STDERR_FILENO);
@@ -221,6 +891,11 @@ static void restore_file_descriptors(int original_stdin, int original_stdout,
 	close(original_stdin);
 	close(original_stdout);
 	close(original_stderr);
+
+	while (multios_count > 0 &&
+		   multios[multios_count - 1].depth == redirect_depth)
+		wait_child(multios[--multios_count].pid, &status);
+	redirect_depth--;
 }
 
 /**
@@ -250,12 +925,25 @@ static int parse_simple(simple_command_t *s, int level, command_t *father)
 	char **argv = get_argv(s, &argc);
 	// Duplicate file descriptors
 	int original_stdin, original_stdout, original_stderr;
+	uint64_t start = stats_now();
+	int redirect_status;
 
+	trace_simple(TRACE_BEGIN, s, argv, level, 0, 0);
+	// Skip an up to date command, before its outputs are truncated
+	if (incremental_enabled() && !is_builtin(s) && incremental_fresh(s, argv)) {
+		free_command(argv, argc, command);
+		trace_simple(TRACE_END, s, NULL, level, 0, 0);
+		return 0;
+	}
 	duplicate_file_descriptors(&original_stdin, &original_stdout,
 							   &original_stderr);
 	// Apply redirections
-	if (apply_redirections(s) == -1) {
+	redirect_status = apply_redirections(s);
+	stats_record(STATS_REDIRECT, start);
+	if (redirect_status == -1) {
 		free_command(argv, argc, command);
+		restore_file_descriptors(original_stdin, original_stdout, original_stderr);
+		trace_simple(TRACE_END, s, NULL, level, 0, -1);
 		return -1;
 	}
 
@@ -264,14 +952,65 @@ static int parse_simple(simple_command_t *s, int level, command_t *father)
 	if (strcmp(command, "exit") == 0 || strcmp(command, "quit") == 0) {
 		free_command(argv, argc, command);
 		restore_file_descriptors(original_stdin, original_stdout, original_stderr);
+		trace_simple(TRACE_END, s, NULL, level, 0, last_status);
 		return shell_exit();
 	} else if (strcmp(command, "cd") == 0) {
 		bool ret = shell_cd(s->params);
 
 		free_command(argv, argc, command);
 		restore_file_descriptors(original_stdin, original_stdout, original_stderr);
+		trace_simple(TRACE_END, s, NULL, level, 0, ret ? 0 : 1);
+
+		return ret ? 0 : 1;
+	} else if (strcmp(command, "set") == 0) {
+		bool ret = shell_set(s->params);
+
+		free_command(argv, argc, command);
+		restore_file_descriptors(original_stdin, original_stdout, original_stderr);
+		trace_simple(TRACE_END, s, NULL, level, 0, ret ? 0 : 1);
+
+		return ret ? 0 : 1;
+	} else if (strcmp(command, "shellstats") == 0) {
+		bool ret = shell_stats(s->params);
+
+		free_command(argv, argc, command);
+		restore_file_descriptors(original_stdin, original_stdout, original_stderr);
+		trace_simple(TRACE_END, s, NULL, level, 0, ret ? 0 : 1);
 
 		return ret ? 0 : 1;
+	} else if (strcmp(command, "time") == 0) {
+		int ret = time_nothing(s->params);
+
+		free_command(argv, argc, command);
+		restore_file_descriptors(original_stdin, original_stdout, original_stderr);
+		trace_simple(TRACE_END, s, NULL, level, 0, ret);
+
+		return ret;
+	} else if (strcmp(command, "memo") == 0 && s->params != NULL) {
+		int ret = memo_run(s, argv + 1, level, father, parse_simple);
+
+		free_command(argv, argc, command);
+		restore_file_descriptors(original_stdin, original_stdout, original_stderr);
+		trace_simple(TRACE_END, s, NULL, level, 0, ret);
+
+		return ret;
+	} else if (is_pure_builtin(command)) {
+		int ret = shell_pure(argv);
+
+		free_command(argv, argc, command);
+		restore_file_descriptors(original_stdin, original_stdout, original_stderr);
+		trace_simple(TRACE_END, s, NULL, level, 0, ret);
+
+		return ret;
+	}
+
+	// Check if command is cat or tee, unless it needs the external command
+	redirect_status = shell_copy(argv);
+	if (redirect_status != -1) {
+		free_command(argv, argc, command);
+		restore_file_descriptors(original_stdin, original_stdout, original_stderr);
+		trace_simple(TRACE_END, s, NULL, level, 0, redirect_status);
+		return redirect_status;
 	}
 
 	// Check if command is environment variable assignment
@@ -279,32 +1018,47 @@ static int parse_simple(simple_command_t *s, int level, command_t *father)
 		parse_environment_variable(command);
 		free_command(argv, argc, command);
 		restore_file_descriptors(original_stdin, original_stdout, original_stderr);
+		trace_simple(TRACE_END, s, NULL, level, 0, 0);
 		return 0;
 	}
 
 	// Check if command is external
 	// Create child process
-	pid_t pid = fork();
+	start = stats_now();
+	// Through the spawn server if there is one, its fork() stays cheap
+	const int fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+	pid_t pid = zygote_enabled() && !has_user_fds(s) ?
+				zygote_spawn(argv, fds) : -1;
+
+	if (pid == -1)
+		pid = fork();
+	stats_record(STATS_SPAWN, start);
 
 	if (pid == -1) {
 		free_command(argv, argc, command);
 		restore_file_descriptors(original_stdin, original_stdout, original_stderr);
 		perror("fork");
+		trace_simple(TRACE_END, s, NULL, level, 0, -1);
 		return -1;
 	}
 
 	// Execute command
 	if (pid == 0) {
-		execvp(command, argv);
-		printf("Execution failed for '%s'\n", command);
-		exit(127);
+		exec_command(argv);
 	} else {
 		int status;
 
 		// Wait for child process to finish
-		waitpid(pid, &status, 0);
+		start = stats_now();
+		wait_child(pid, &status);
+		stats_record(STATS_WAIT, start);
+
+		start = stats_now();
 		restore_file_descriptors(original_stdin, original_stdout, original_stderr);
+		stats_record(STATS_RESTORE, start);
+		incremental_record(s, argv, WEXITSTATUS(status));
 		free_command(argv, argc, command);
+		trace_simple(TRACE_END, s, NULL, level, pid, WEXITSTATUS(status));
 
 		return WEXITSTATUS(status);
 	}
@@ -314,98 +1068,454 @@ static int parse_simple(simple_command_t *s, int level, command_t *father)
 }
 
 /**
- * Process two commands in parallel, by creating two children.
+ * Run the commands of a group, with the redirections of the group applied
+ * once around all of them: in the shell for a brace group, in the child
+ * already forked for a subshell.
  */
-static bool run_in_parallel(command_t *cmd1, command_t *cmd2, int level,
-							command_t *father)
+static int run_group(command_t *c, int level)
 {
-	pid_t pid1, pid2;
-	int status1, status2;
+	int original_stdin, original_stdout, original_stderr, exit_status;
 
-	// Create first child process
-	pid1 = fork();
-	if (pid1 == -1) {
-		perror("fork");
-		return false;
+	duplicate_file_descriptors(&original_stdin, &original_stdout,
+							   &original_stderr);
+	if (apply_redirections(c->scmd) == -1) {
+		restore_file_descriptors(original_stdin, original_stdout,
+								 original_stderr);
+		return -1;
 	}
-	// Execute first command
-	if (pid1 == 0)
-		exit(parse_command(cmd1, level + 1, father));
 
-	// Create second child process
-	pid2 = fork();
-	if (pid2 == -1) {
-		perror("fork");
+	exit_status = parse_command(c->cmd1, level + 1, c);
+	restore_file_descriptors(original_stdin, original_stdout, original_stderr);
+
+	return exit_status;
+}
+
+/**
+ * Run a command in a forked child and terminate the child. When all that
+ * is left to do is a single external command, the child execs it directly
+ * instead of forking a grandchild and waiting for it.
+ */
+static void __attribute__((noreturn)) run_in_child(command_t *c, int level,
+												   command_t *father)
+{
+	// Commands that may be up to date or need tees for their redirections
+	// go through parse_simple() instead
+	if (c->op == OP_NONE && !is_builtin(c->scmd) && !incremental_enabled() &&
+		!has_multios(c->scmd)) {
+		int argc;
+		char **argv = get_argv(c->scmd, &argc);
+
+		trace_simple(TRACE_INSTANT, c->scmd, argv, level, 0, 0);
+		if (apply_redirections(c->scmd) == -1)
+			exit_child(-1);
+		exec_command(argv);
+	}
+
+	// A subshell is already in a child of its own
+	if (c->op == OP_SUBSHELL)
+		exit_child(shell_exit_status(run_group(c, level)));
+
+	exit_child(shell_exit_status(parse_command(c, level, father)));
+}
+
+/**
+ * Check if a command is a simple command the shell can run without forking,
+ * even as a stage of a pipe or parallel command.
+ */
+static bool is_pure(command_t *c)
+{
+	char *command;
+	bool ret;
+
+	if (c->op != OP_NONE)
 		return false;
+
+	command = get_word(c->scmd->verb);
+	ret = is_pure_builtin(command);
+	free(command);
+
+	return ret;
+}
+
+/**
+ * Fork a child running a command, with stdin or stdout (given by fd)
+ * replaced by an end of the pipe; pipefd may be NULL.
+ */
+static pid_t fork_stage(command_t *c, int level, command_t *father,
+						int *pipefd, int fd)
+{
+	uint64_t start = stats_now();
+	pid_t pid = fork();
+
+	if (pid == -1) {
+		perror("fork");
+		return -1;
 	}
-	// Execute second command
+
+	if (pid == 0) {
+		if (pipefd != NULL) {
+			close(pipefd[fd == STDIN_FILENO ? WRITE : READ]);
+			dup2(pipefd[fd == STDIN_FILENO ? READ : WRITE], fd);
+			close(pipefd[fd == STDIN_FILENO ? READ : WRITE]);
+		}
+		run_in_child(c, level, father);
+	}
+	stats_record(STATS_SPAWN, start);
+
+	return pid;
+}
+
+/**
+ * Start a stage of a pipe or parallel command like fork_stage(). A single
+ * external command without redirections is started by the spawn server
+ * instead, with the end of the pipe as stdin or stdout.
+ */
+static pid_t spawn_stage(command_t *c, int level, command_t *father,
+						 int *pipefd, int fd)
+{
+	int fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO }, argc;
+	uint64_t start;
+	char **argv;
+	pid_t pid;
+
+	if (!zygote_enabled() || c->op != OP_NONE || is_builtin(c->scmd) ||
+		c->scmd->in != NULL || c->scmd->out != NULL || c->scmd->err != NULL ||
+		c->scmd->dup != NULL)
+		return fork_stage(c, level, father, pipefd, fd);
+
+	start = stats_now();
+	if (pipefd != NULL)
+		fds[fd] = pipefd[fd == STDIN_FILENO ? READ : WRITE];
+	argv = get_argv(c->scmd, &argc);
+	trace_simple(TRACE_INSTANT, c->scmd, argv, level, 0, 0);
+	pid = zygote_spawn(argv, fds);
+	free_command(argv, argc, NULL);
+	stats_record(STATS_SPAWN, start);
+
+	return pid != -1 ? pid : fork_stage(c, level, father, pipefd, fd);
+}
+
+/**
+ * Start a command of a ; sequence run by autopar in a child of its own.
+ */
+static pid_t spawn_job(command_t *c, int level, command_t *father)
+{
+	return fork_stage(c, level, father, NULL, -1);
+}
+
+/**
+ * Run a pure command inside the shell with stdin or stdout (given by fd)
+ * temporarily replaced by a pipe end, which is closed afterwards. SIGPIPE
+ * is ignored meanwhile, so a reader going away shows up as EPIPE instead of
+ * killing the shell.
+ */
+static int run_inline(command_t *c, int level, command_t *father, int end,
+					  int fd)
+{
+	struct sigaction ignore = { .sa_handler = SIG_IGN }, saved_action;
+	int saved = save_fd(fd), exit_status;
+
+	if (saved == -1) {
+		perror("dup");
+		close(end);
+		return -1;
+	}
+	dup_fd(end, fd);
+	close(end);
+
+	sigaction(SIGPIPE, &ignore, &saved_action);
+	exit_status = parse_command(c, level, father);
+	sigaction(SIGPIPE, &saved_action, NULL);
+
+	dup_fd(saved, fd);
+	close(saved);
+
+	return exit_status;
+}
+
+/**
+ * Process two commands in parallel, by creating two children. Pure
+ * internal commands run inside the shell once the other child is started.
+ */
+static bool run_in_parallel(command_t *cmd1, command_t *cmd2, int level,
+							command_t *father)
+{
+	pid_t pid1 = 0, pid2 = 0;
+	int status1, status2, exit_status = 0;
+	uint64_t start;
+
+	trace_fork(TRACE_BEGIN, "parallel-fork", level, NULL, 0, 0, 0);
+
+	// Create a child process for every command that needs one
+	if (!is_pure(cmd1)) {
+		pid1 = spawn_stage(cmd1, level + 1, father, NULL, -1);
+		if (pid1 == -1)
+			return false;
+	}
+	if (!is_pure(cmd2)) {
+		pid2 = spawn_stage(cmd2, level + 1, father, NULL, -1);
+		if (pid2 == -1) {
+			if (pid1 > 0)
+				wait_child(pid1, &status1);
+			return false;
+		}
+	}
+
+	if (pid1 == 0)
+		parse_command(cmd1, level + 1, father);
 	if (pid2 == 0)
-		exit(parse_command(cmd2, level + 1, father));
+		exit_status = parse_command(cmd2, level + 1, father);
 
 	// Wait for child processes to finish
-	waitpid(pid1, &status1, 0);
-	waitpid(pid2, &status2, 0);
+	start = stats_now();
+	if (pid1 > 0)
+		wait_child(pid1, &status1);
+	if (pid2 > 0) {
+		wait_child(pid2, &status2);
+		exit_status = WEXITSTATUS(status2);
+	}
+	stats_record(STATS_WAIT, start);
+	trace_fork(TRACE_END, "parallel-fork", level, NULL, pid1, pid2,
+			   exit_status);
 
 	return true;
 }
 
 /**
- * Run commands by creating an anonymous pipe (cmd1 | cmd2).
+ * Run commands by creating an anonymous pipe (cmd1 | cmd2). A pure
+ * internal command at either end runs inside the shell instead of a child.
  */
 static bool run_on_pipe(command_t *cmd1, command_t *cmd2, int level,
 						command_t *father)
 {
-	int pipefd[2];
-	pid_t pid1, pid2;
-
-	// Create pipe
-	if (pipe(pipefd) == -1) {
-		perror("pipe");
+	bool inline1 = is_pure(cmd1), inline2 = is_pure(cmd2);
+	int pipefd[2], status1, status2, exit_status = 0;
+	pid_t pid1 = 0, pid2 = 0;
+	uint64_t start;
+
+	// Create pipe, its ends only reach the stages through dup2()
+	if (pipe2(pipefd, O_CLOEXEC) == -1) {
+		perror("pipe2");
 		return false;
 	}
-	// Create first child process
-	pid1 = fork();
-	if (pid1 == -1) {
-		perror("fork");
+	trace_fork(TRACE_BEGIN, "pipe-fork", level, pipefd, 0, 0, 0);
+
+	// Create the child processes, the reader first
+	if (!inline2)
+		pid2 = spawn_stage(cmd2, level + 1, father, pipefd, STDIN_FILENO);
+	if (!inline1 && pid2 != -1)
+		pid1 = spawn_stage(cmd1, level + 1, father, pipefd, STDOUT_FILENO);
+	if (pid1 == -1 || pid2 == -1) {
+		close(pipefd[READ]);
+		close(pipefd[WRITE]);
+		if (pid2 > 0)
+			wait_child(pid2, &status2);
 		return false;
 	}
-	// Execute first command
-	if (pid1 == 0) {
-		close(pipefd[0]);
-		dup2(pipefd[1], STDOUT_FILENO);
-		close(pipefd[1]);
-		// Execute cmd1
-		exit(parse_command(cmd1, level + 1, father));
-		// Parent process
-	} else {
-		// Create second child process
-		pid2 = fork();
-		if (pid2 == -1) {
-			perror("fork");
-			return false;
+
+	// A pure command never reads its input, so an inline reader goes first
+	// and an inline writer cannot block on a full pipe nobody drains
+	if (inline2)
+		exit_status = run_inline(cmd2, level + 1, father, pipefd[READ],
+								 STDIN_FILENO);
+	else
+		close(pipefd[READ]);
+	if (inline1)
+		run_inline(cmd1, level + 1, father, pipefd[WRITE], STDOUT_FILENO);
+	else
+		close(pipefd[WRITE]);
+
+	// Wait for child processes to finish
+	start = stats_now();
+	if (pid1 > 0)
+		wait_child(pid1, &status1);
+	if (pid2 > 0) {
+		wait_child(pid2, &status2);
+		exit_status = WEXITSTATUS(status2);
+	}
+	stats_record(STATS_WAIT, start);
+	trace_fork(TRACE_END, "pipe-fork", level, NULL, pid1, pid2, exit_status);
+
+	return exit_status ? false : true;
+}
+
+/**
+ * Fork a stage of a fan-out with stdin or stdout (given by fd) replaced by
+ * end. Every pipe of the fan-out is closed in the child, so that a consumer
+ * sees the end of its input as soon as the tee is done.
+ */
+static pid_t fork_fanout_stage(command_t *c, int level, command_t *father,
+							   int *pipes, int count, int end, int fd)
+{
+	uint64_t start = stats_now();
+	pid_t pid = fork();
+
+	if (pid == -1) {
+		perror("fork");
+		return -1;
+	}
+
+	if (pid == 0) {
+		dup2(end, fd);
+		for (int i = 0; i < 2 * count; i++)
+			close(pipes[i]);
+		run_in_child(c, level, father);
+	}
+	stats_record(STATS_SPAWN, start);
+
+	return pid;
+}
+
+/**
+ * Fork the child of a fan-out that copies what the producer writes to the
+ * first pipe into the pipes of the consumers, with tee().
+ */
+static pid_t fork_fanout_tee(int *pipes, int count)
+{
+	pid_t pid = fork();
+	int *outs;
+
+	if (pid == -1)
+		perror("fork");
+	if (pid != 0)
+		return pid;
+
+	outs = malloc((count - 1) * sizeof(*outs));
+	DIE(outs == NULL, "malloc");
+	for (int i = 1; i < count; i++) {
+		outs[i - 1] = pipes[2 * i + WRITE];
+		close(pipes[2 * i + READ]);
+	}
+	// A consumer going away only drops its pipe, the producer gets a broken
+	// pipe once they all have
+	close(pipes[WRITE]);
+	close(STDIN_FILENO);
+	close(STDOUT_FILENO);
+	close(STDERR_FILENO);
+	signal(SIGPIPE, SIG_IGN);
+	_exit(tee_fds(pipes[READ], outs, count - 1) == 0 ? 0 : 1);
+}
+
+/**
+ * Create count pipes, the ends of pipe i being pipes[2 * i + READ] and
+ * pipes[2 * i + WRITE]. Returns 0 on success and -1 on error.
+ */
+static int open_pipes(int *pipes, int count)
+{
+	for (int i = 0; i < count; i++) {
+		if (pipe2(pipes + 2 * i, O_CLOEXEC) == 0)
+			continue;
+
+		perror("pipe2");
+		while (i-- > 0) {
+			close(pipes[2 * i + READ]);
+			close(pipes[2 * i + WRITE]);
 		}
-		// Execute second command
-		if (pid2 == 0) {
-			close(pipefd[1]);
-			dup2(pipefd[0], STDIN_FILENO);
-			close(pipefd[0]);
-
-			// Execute cmd2
-			exit(parse_command(cmd2, level + 1, father));
-			// Back to parent process
-		} else {
-			close(pipefd[0]);
-			close(pipefd[1]);
+		return -1;
+	}
 
-			int status1, status2;
+	return 0;
+}
 
-			// Wait for child processes to finish
-			waitpid(pid1, &status1, 0);
-			waitpid(pid2, &status2, 0);
+/**
+ * Run a fan-out (producer |> a |> b ...): the producer writes to a pipe,
+ * which a child copies with tee() into one pipe per consumer, so that the
+ * producer runs once and the consumers read concurrently. Returns the exit
+ * status of the last consumer.
+ */
+static int run_fanout(command_t *c, int level)
+{
+	int count = 1, started = 0, status, exit_status = 1, *pipes;
+	pid_t *pids, producer_pid = 0, last_pid = 0;
+	command_t **stages, *f = c;
+	uint64_t start;
+
+	// Stage 0 is the producer, the others the cmd2 of the chain, in order
+	for (; f->op == OP_FANOUT; f = f->cmd1)
+		count++;
+	stages = malloc(count * sizeof(*stages));
+	pipes = malloc(2 * count * sizeof(*pipes));
+	pids = malloc((count + 1) * sizeof(*pids));
+	DIE(stages == NULL || pipes == NULL || pids == NULL, "malloc");
+	stages[0] = f;
+	f = c;
+	for (int i = count - 1; i > 0; i--, f = f->cmd1)
+		stages[i] = f->cmd2;
+
+	if (open_pipes(pipes, count) == 0) {
+		trace_fork(TRACE_BEGIN, "fanout-fork", level, NULL, 0, 0, 0);
+
+		// The consumers first, then the tee and the producer
+		for (int i = 1; i < count && started == i - 1; i++) {
+			pids[started] = fork_fanout_stage(stages[i], level + 1, c, pipes,
+											  count, pipes[2 * i + READ],
+											  STDIN_FILENO);
+			if (pids[started] != -1)
+				last_pid = pids[started++];
+		}
+		if (started == count - 1) {
+			pids[started] = fork_fanout_tee(pipes, count);
+			if (pids[started] != -1)
+				started++;
+		}
+		if (started == count) {
+			pids[started] = fork_fanout_stage(stages[0], level + 1, c, pipes,
+											  count, pipes[WRITE],
+											  STDOUT_FILENO);
+			if (pids[started] != -1)
+				producer_pid = pids[started++];
+		}
+
+		// Without the shell's ends, the stages see the others go away
+		for (int i = 0; i < 2 * count; i++)
+			close(pipes[i]);
 
-			return WEXITSTATUS(status2) ? false : true;
+		start = stats_now();
+		for (int i = 0; i < started; i++) {
+			wait_child(pids[i], &status);
+			if (pids[i] == last_pid && started == count + 1)
+				exit_status = WEXITSTATUS(status);
 		}
+		stats_record(STATS_WAIT, start);
+		trace_fork(TRACE_END, "fanout-fork", level, NULL, producer_pid,
+				   last_pid, exit_status);
 	}
+
+	free(stages);
+	free(pipes);
+	free(pids);
+	return exit_status;
+}
+
+/**
+ * Run the commands of a subshell in a child, so that they cannot change
+ * the state of the shell.
+ */
+static int run_subshell(command_t *c, int level, command_t *father)
+{
+	pid_t pid = fork_stage(c, level, father, NULL, -1);
+	int status;
+
+	if (pid == -1)
+		return -1;
+	wait_child(pid, &status);
+
+	return WEXITSTATUS(status);
+}
+
+/**
+ * Run a command prefixed by the time keyword and report its resource usage.
+ */
+static int run_timed(command_t *c, int level, command_t *father, int format)
+{
+	time_frame_t frame;
+	int exit_status;
+
+	time_frame_begin(&frame, format);
+	exit_status = parse_command(c, level, father);
+	time_frame_end(&frame, exit_status);
+
+	return exit_status;
 }
 
 /**
@@ -413,24 +1523,51 @@ static bool run_on_pipe(command_t *cmd1, command_t *cmd2, int level,
  */
 int parse_command(command_t *c, int level, command_t *father)
 {
-	int exit_status = 0;
+	int exit_status = 0, format;
+	bool batched;
 
 	// Check if command is null
 	if (c == NULL)
 		return exit_status;
 
+	// Check if a pipeline or and-or list is prefixed by the time keyword
+	if ((father == NULL || father->op == OP_SEQUENTIAL ||
+		 father->op == OP_PARALLEL || father->op == OP_BRACE_GROUP ||
+		 father->op == OP_SUBSHELL) &&
+		c->op != OP_SEQUENTIAL && c->op != OP_PARALLEL &&
+		time_strip_keyword(c, &format))
+		return run_timed(c, level, father, format);
+
 	// Check if command is simple, if so execute it
 	if (c->op == OP_NONE) {
 		exit_status = parse_simple(c->scmd, level, c);
+		if (exit_status != SHELL_EXIT)
+			last_status = exit_status;
 		return exit_status;
 	}
 
+	trace_command(TRACE_BEGIN, c, level, 0);
+
+	// Open the redirections of all the stages of a pipe / parallel group
+	// together, before any of them is spawned
+	batched = (c->op == OP_PIPE || c->op == OP_PARALLEL) &&
+			  (father == NULL || (father->op != OP_PIPE &&
+								  father->op != OP_PARALLEL)) &&
+			  uring_open_redirections(c);
+
 	// Check if command is sequential, parallel, conditional or pipe
 	switch (c->op) {
 	// Execute first command and then second command
 	case OP_SEQUENTIAL:
+		// The whole sequence may run as a dataflow graph instead
+		if (autopar_enabled() && (father == NULL ||
+								  father->op != OP_SEQUENTIAL)) {
+			exit_status = autopar_run(c, level + 1, spawn_job, parse_command);
+			break;
+		}
 		exit_status = parse_command(c->cmd1, level + 1, c);
-		exit_status = parse_command(c->cmd2, level + 1, c);
+		if (exit_status != SHELL_EXIT)
+			exit_status = parse_command(c->cmd2, level + 1, c);
 		break;
 
 	// Execute commands simultaneously
@@ -441,7 +1578,7 @@ int parse_command(command_t *c, int level, command_t *father)
 	// Execute second command only if first command returns non zero
 	case OP_CONDITIONAL_NZERO:
 		exit_status = parse_command(c->cmd1, level + 1, c);
-		if (exit_status != 0)
+		if (exit_status != 0 && exit_status != SHELL_EXIT)
 			exit_status = parse_command(c->cmd2, level + 1, c);
 		break;
 
@@ -457,10 +1594,30 @@ int parse_command(command_t *c, int level, command_t *father)
 		exit_status = run_on_pipe(c->cmd1, c->cmd2, level + 1, c) ? 0 : 1;
 		break;
 
+	// Execute the commands of a group, in the shell or in a child
+	case OP_BRACE_GROUP:
+		exit_status = run_group(c, level);
+		break;
+
+	case OP_SUBSHELL:
+		exit_status = run_subshell(c, level, father);
+		break;
+
+	// Execute the producer once and all the consumers on its output
+	case OP_FANOUT:
+		exit_status = run_fanout(c, level + 1);
+		break;
+
 	// Default case
 	default:
 		return SHELL_EXIT;
 	}
 
+	if (batched)
+		uring_close_redirections();
+
+	trace_command(TRACE_END, c, level, shell_exit_status(exit_status));
+	if (exit_status != SHELL_EXIT)
+		last_status = exit_status;
 	return exit_status;
 }
@@ -12,4 +12,10 @@
  */
 int parse_command(command_t *cmd, int level, command_t *father);
 
+/**
+ * Map the status returned by parse_command() to the exit status of the
+ * shell: exit terminates it with the status of the last command.
+ */
+int shell_exit_status(int status);
+
 #endif /* _CMD_H */
@@ -0,0 +1,338 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#define _GNU_SOURCE
+
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "copy.h"
+#include "utils.h"
+
+/* Bytes moved by one system call. */
+#define COPY_CHUNK	(1 << 20)
+
+/* Buffer of the read()/write() loop. */
+#define BUFFER_SIZE	(128 * 1024)
+
+/**
+ * Check if an error only means that a way of copying does not apply to
+ * the descriptors (kernel, file system or open flags), so another one
+ * should be tried.
+ */
+static bool unsupported(int error)
+{
+	return error == EINVAL || error == ENOSYS || error == EXDEV ||
+		   error == EOPNOTSUPP || error == EBADF;
+}
+
+/**
+ * Check the type of a descriptor.
+ */
+static bool is_type(int fd, mode_t type)
+{
+	struct stat st;
+
+	return fstat(fd, &st) == 0 && (st.st_mode & S_IFMT) == type;
+}
+
+/**
+ * Copy with read() and write().
+ */
+static int copy_loop(int in, int out)
+{
+	char *buffer = malloc(BUFFER_SIZE);
+	ssize_t n;
+
+	DIE(buffer == NULL, "malloc");
+
+	while ((n = read(in, buffer, BUFFER_SIZE)) != 0) {
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 || write_all(out, buffer, n) != n)
+			break;
+	}
+
+	free(buffer);
+	return n == 0 ? 0 : -1;
+}
+
+/**
+ * Copy everything from in to out.
+ */
+int copy_fd(int in, int out)
+{
+	bool file_in = is_type(in, S_IFREG);
+	ssize_t n;
+
+	// Between regular files, the file system may even share the blocks
+	if (file_in && is_type(out, S_IFREG)) {
+		do {
+			n = copy_file_range(in, NULL, out, NULL, COPY_CHUNK, 0);
+		} while (n > 0 || (n < 0 && errno == EINTR));
+		if (n == 0)
+			return 0;
+		if (!unsupported(errno))
+			return -1;
+	}
+
+	// From a regular file to anything (pipe, socket, O_APPEND file)
+	if (file_in) {
+		do {
+			n = sendfile(out, in, NULL, COPY_CHUNK);
+		} while (n > 0 || (n < 0 && errno == EINTR));
+		if (n == 0)
+			return 0;
+		if (!unsupported(errno))
+			return -1;
+	}
+
+	// To or from a pipe
+	if (is_type(in, S_IFIFO) || is_type(out, S_IFIFO)) {
+		do {
+			n = splice(in, NULL, out, NULL, COPY_CHUNK, SPLICE_F_MOVE);
+		} while (n > 0 || (n < 0 && errno == EINTR));
+		if (n == 0)
+			return 0;
+		if (!unsupported(errno))
+			return -1;
+	}
+
+	return copy_loop(in, out);
+}
+
+/**
+ * Move exactly count bytes from a pipe to a descriptor, through a buffer
+ * if the descriptor refuses splice(). On error the bytes left are read
+ * and dropped anyway, so the pipe stays in step with the other outputs.
+ */
+static int splice_all(int in, int out, size_t count)
+{
+	char *buffer = NULL;
+	bool failed = false;
+	ssize_t n;
+
+	while (count > 0) {
+		n = splice(in, NULL, out, NULL, count, SPLICE_F_MOVE);
+		if (n > 0) {
+			count -= n;
+			continue;
+		}
+		if (n < 0 && errno == EINTR)
+			continue;
+		failed = n == 0 || !unsupported(errno);
+		break;
+	}
+	if (count == 0)
+		return 0;
+
+	buffer = malloc(count);
+	DIE(buffer == NULL, "malloc");
+	while (count > 0 && ((n = read(in, buffer, count)) > 0 ||
+						 (n < 0 && errno == EINTR))) {
+		if (n < 0)
+			continue;
+		if (!failed && write_all(out, buffer, n) != n)
+			failed = true;
+		count -= n;
+	}
+	free(buffer);
+
+	return failed || count > 0 ? -1 : 0;
+}
+
+/**
+ * Copy everything from in to every output, reading once and writing to
+ * all of them.
+ */
+static int tee_loop(int in, int *outs, int count)
+{
+	char *buffer = malloc(BUFFER_SIZE);
+	int ret = 0;
+	ssize_t n;
+
+	DIE(buffer == NULL, "malloc");
+
+	while ((n = read(in, buffer, BUFFER_SIZE)) != 0) {
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			ret = -1;
+			break;
+		}
+
+		for (int i = 0; i < count; i++) {
+			if (outs[i] < 0 || write_all(outs[i], buffer, n) == n)
+				continue;
+			outs[i] = -1;
+			ret = -1;
+		}
+	}
+
+	free(buffer);
+	return ret;
+}
+
+/**
+ * Create a pipe that holds at least size bytes.
+ */
+static int scratch_pipe(int fds[2], int size)
+{
+	if (pipe2(fds, O_CLOEXEC) == -1)
+		return -1;
+	if (fcntl(fds[1], F_SETPIPE_SZ, size) >= size)
+		return 0;
+
+	close(fds[0]);
+	close(fds[1]);
+	return -1;
+}
+
+/**
+ * Copy everything from a pipe to two or more descriptors without the data
+ * going through user space: each chunk is duplicated with tee() into a
+ * scratch pipe before being moved to the first output, then from scratch
+ * pipe to scratch pipe before being moved to each of the next ones. An
+ * output that fails is set to -1 and dropped.
+ * Returns -2 when tee() does not apply; nothing is lost, since tee() does
+ * not consume its input.
+ */
+static int tee_splice(int in, int *outs, int count)
+{
+	int pipes[2][2], size = fcntl(in, F_GETPIPE_SZ), ret = 0, last;
+	ssize_t n, m;
+
+	// Scratch pipes as large as in always have room for what tee() takes
+	if (size <= 0 || scratch_pipe(pipes[0], size) != 0)
+		return -2;
+	if (scratch_pipe(pipes[1], size) != 0) {
+		close(pipes[0][0]);
+		close(pipes[0][1]);
+		return -2;
+	}
+
+	for (;;) {
+		for (last = count - 1; last > 0 && outs[last] < 0; last--)
+			;
+		// With a single output left, it just takes the data
+		if (last == 0) {
+			if (outs[0] < 0 || copy_fd(in, outs[0]) != 0)
+				ret = -1;
+			break;
+		}
+
+		n = tee(in, pipes[0][1], COPY_CHUNK, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			if (n < 0)
+				ret = unsupported(errno) ? -2 : -1;
+			break;
+		}
+
+		if (splice_all(in, outs[0], n) != 0)
+			ret = outs[0] = -1;
+		for (int i = 1, from = 0; i <= last; i++, from = !from) {
+			// The last output takes the data, the others get a copy of it
+			m = i < last ? tee(pipes[from][0], pipes[!from][1], n, 0) : n;
+			if (m != n) {
+				// Should not happen with pipes of the same size: drop the
+				// outputs after this one
+				splice_all(pipes[!from][0], -1, m > 0 ? m : 0);
+				for (int j = i + 1; j <= last; j++)
+					outs[j] = -1;
+				ret = -1;
+				last = i;
+			}
+			if (splice_all(pipes[from][0], outs[i], n) != 0)
+				ret = outs[i] = -1;
+		}
+	}
+
+	for (int i = 0; i < 2; i++) {
+		close(pipes[i][0]);
+		close(pipes[i][1]);
+	}
+	return ret;
+}
+
+/**
+ * Copy everything from in to every descriptor of outs.
+ */
+int tee_fds(int in, int *outs, int count)
+{
+	int ret;
+
+	ssize_t n;
+
+	if (count == 1)
+		return copy_fd(in, outs[0]);
+
+	// From a pipe to a pipe and one more descriptor, the data is duplicated
+	// into the first with tee() and then moved to the second with splice()
+	if (count == 2 && is_type(in, S_IFIFO) && is_type(outs[0], S_IFIFO)) {
+		do {
+			n = tee(in, outs[0], COPY_CHUNK, 0);
+			if (n > 0 && splice_all(in, outs[1], n) != 0) {
+				// Keep feeding the first output only
+				copy_fd(in, outs[0]);
+				return -1;
+			}
+		} while (n > 0 || (n < 0 && errno == EINTR));
+		if (n == 0)
+			return 0;
+		// Keep feeding the second output only
+		if (errno == EPIPE) {
+			copy_fd(in, outs[1]);
+			return -1;
+		}
+		if (!unsupported(errno))
+			return -1;
+	}
+
+	// From a pipe to any descriptors, through scratch pipes
+	if (is_type(in, S_IFIFO)) {
+		ret = tee_splice(in, outs, count);
+		if (ret != -2)
+			return ret;
+	}
+
+	return tee_loop(in, outs, count);
+}
+
+/**
+ * Start a child copying what is written to a pipe into outs.
+ */
+int start_tee(int *outs, int count, pid_t *pid)
+{
+	int pipefd[2];
+
+	if (pipe2(pipefd, O_CLOEXEC) == -1)
+		return -1;
+
+	*pid = fork();
+	if (*pid == -1) {
+		close(pipefd[0]);
+		close(pipefd[1]);
+		return -1;
+	}
+
+	if (*pid == 0) {
+		// Drop the write ends of the other tees, kept as stdout or stderr
+		close(pipefd[1]);
+		close(STDIN_FILENO);
+		close(STDOUT_FILENO);
+		close(STDERR_FILENO);
+		signal(SIGPIPE, SIG_IGN);
+		_exit(tee_fds(pipefd[0], outs, count) == 0 ? 0 : 1);
+	}
+
+	close(pipefd[0]);
+	return pipefd[1];
+}
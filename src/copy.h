@@ -0,0 +1,33 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef _COPY_H
+#define _COPY_H
+
+#include <sys/types.h>
+
+/**
+ * Copy everything from in to out, in the kernel (copy_file_range(),
+ * sendfile() or splice()) when the descriptors allow it.
+ * Returns 0 on success and -1 on error (errno is set).
+ */
+int copy_fd(int in, int out);
+
+/**
+ * Copy everything from in to every descriptor of outs, in the kernel
+ * (tee() and splice()) when in is a pipe. An output that fails is dropped
+ * and the others still get the data.
+ * Returns 0 on success and -1 if an output (or in) failed.
+ */
+int tee_fds(int in, int *outs, int count);
+
+/**
+ * Start a child copying what is written to a new pipe into every descriptor
+ * of outs with tee_fds(); the caller still closes outs. The child keeps no
+ * other write end of a pipe, so it sees the end of its input once the
+ * returned one and its copies are closed.
+ * Returns the write end of the pipe (close-on-exec) and sets pid, or -1 on
+ * error (errno is set).
+ */
+int start_tee(int *outs, int count, pid_t *pid);
+
+#endif /* _COPY_H */
@@ -0,0 +1,88 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <sys/types.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "fdaudit.h"
+#include "utils.h"
+
+/* Where the reports go, -1 when auditing is disabled. */
+static int audit_fd = -1;
+
+/**
+ * Start auditing, reporting to a file or to the current stderr.
+ */
+int fdaudit_enable(const char *value)
+{
+	int fd;
+
+	if (value != NULL && *value != '\0')
+		fd = move_fd_high(open(value, O_WRONLY | O_CREAT | O_APPEND |
+							   O_CLOEXEC, 0644));
+	else
+		fd = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, SHELL_FD_MIN);
+
+	if (fd == -1) {
+		perror("fdaudit");
+		return -1;
+	}
+
+	fdaudit_disable();
+	audit_fd = fd;
+
+	return 0;
+}
+
+/**
+ * Stop auditing.
+ */
+void fdaudit_disable(void)
+{
+	if (audit_fd < 0)
+		return;
+
+	close(audit_fd);
+	audit_fd = -1;
+}
+
+/**
+ * Report the descriptors of /proc/self/fd that are not close-on-exec.
+ */
+void fdaudit_check(char **argv)
+{
+	char path[64], target[256], line[512];
+	struct dirent *entry;
+	DIR *dir;
+	ssize_t n;
+	int fd, len;
+
+	if (audit_fd < 0)
+		return;
+
+	dir = opendir("/proc/self/fd");
+	if (dir == NULL)
+		return;
+
+	while ((entry = readdir(dir)) != NULL) {
+		fd = atoi(entry->d_name);
+		if (entry->d_name[0] == '.' || fd <= STDERR_FILENO || fd == dirfd(dir))
+			continue;
+		if (fcntl(fd, F_GETFD) & FD_CLOEXEC)
+			continue;
+
+		snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+		n = readlink(path, target, sizeof(target) - 1);
+		target[n > 0 ? n : 0] = '\0';
+
+		len = snprintf(line, sizeof(line), "fdaudit: %s (pid %d) inherits fd %d -> %s\n",
+					argv[0], getpid(), fd, target);
+		write_all(audit_fd, line, len < (int)sizeof(line) ? len : sizeof(line) - 1);
+	}
+
+	closedir(dir);
+}
@@ -0,0 +1,24 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef _FDAUDIT_H
+#define _FDAUDIT_H
+
+/**
+ * Start auditing the descriptors external commands inherit (set -o fdaudit).
+ * Reports are appended to the file value, or written to the current stderr.
+ * Returns 0 on success and -1 on error.
+ */
+int fdaudit_enable(const char *value);
+
+/**
+ * Stop auditing (set +o fdaudit).
+ */
+void fdaudit_disable(void);
+
+/**
+ * Report every descriptor other than stdin, stdout and stderr that would
+ * survive an exec of argv. Called in the child right before the exec.
+ */
+void fdaudit_check(char **argv);
+
+#endif /* _FDAUDIT_H */
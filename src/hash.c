@@ -0,0 +1,30 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <string.h>
+
+#include "hash.h"
+
+#define FNV_PRIME	0x100000001b3ULL
+
+/**
+ * Continue an FNV-1a hash with len bytes of data.
+ */
+uint64_t hash_bytes(uint64_t hash, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	for (size_t i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= FNV_PRIME;
+	}
+
+	return hash;
+}
+
+/**
+ * Continue a hash with a string and its NUL.
+ */
+uint64_t hash_string(uint64_t hash, const char *str)
+{
+	return hash_bytes(hash, str, strlen(str) + 1);
+}
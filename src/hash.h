@@ -0,0 +1,23 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef _HASH_H
+#define _HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* FNV-1a offset basis: the hash of no data, where every hash starts. */
+#define HASH_INIT	0xcbf29ce484222325ULL
+
+/**
+ * Continue a 64-bit FNV-1a hash with len bytes of data.
+ */
+uint64_t hash_bytes(uint64_t hash, const void *data, size_t len);
+
+/**
+ * Continue a hash with a string and its NUL, so that consecutive strings
+ * cannot run into each other ("ab" "c" and "a" "bc" differ).
+ */
+uint64_t hash_string(uint64_t hash, const char *str);
+
+#endif /* _HASH_H */
@@ -0,0 +1,421 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hash.h"
+#include "incremental.h"
+#include "utils.h"
+
+/* Index used when set -o incremental names none. */
+#define DEFAULT_INDEX	".mini-shell-incremental"
+
+/*
+ * The index is a log of "key state\n" lines, both 16 hex digits, a state
+ * of 0 forgetting the command; later lines win. Lines are appended with a
+ * single write, so shells (and children running autopar jobs) can share it.
+ */
+#define LINE_LENGTH	34
+
+/* Stale lines tolerated before the index is rewritten when it is opened. */
+#define COMPACT_SLACK	256
+
+/* The last known state of a command. */
+struct entry {
+	uint64_t key;
+	uint64_t state;
+};
+
+static int index_fd = -1;
+static off_t loaded_size;
+static size_t line_count;
+
+/* Open addressing on key, 0 marks a free slot; size is a power of 2. */
+static struct entry *entries;
+static size_t entry_count, entry_size;
+
+/**
+ * Slot of a key: its entry, or the free slot where it belongs.
+ */
+static struct entry *lookup(uint64_t key)
+{
+	size_t i = key & (entry_size - 1);
+
+	while (entries[i].key != 0 && entries[i].key != key)
+		i = (i + 1) & (entry_size - 1);
+
+	return &entries[i];
+}
+
+/**
+ * Set the state of a command, keeping the table at most half full.
+ */
+static void set_entry(uint64_t key, uint64_t state)
+{
+	struct entry *e;
+
+	if (2 * (entry_count + 1) > entry_size) {
+		struct entry *old = entries;
+		size_t old_size = entry_size;
+
+		entry_size = entry_size ? 2 * entry_size : 256;
+		entries = calloc(entry_size, sizeof(*entries));
+		DIE(entries == NULL, "calloc");
+		for (size_t i = 0; i < old_size; i++)
+			if (old[i].key != 0)
+				*lookup(old[i].key) = old[i];
+		free(old);
+	}
+
+	e = lookup(key);
+	if (e->key == 0) {
+		e->key = key;
+		entry_count++;
+	}
+	e->state = state;
+}
+
+/**
+ * Last known state of a command, 0 if it is not known.
+ */
+static uint64_t get_state(uint64_t key)
+{
+	return entry_size != 0 ? lookup(key)->state : 0;
+}
+
+/**
+ * Read the lines appended to the index since it was last read, by this
+ * shell or by another process.
+ */
+static void sync_index(void)
+{
+	char buffer[128 * LINE_LENGTH], field[17];
+	ssize_t n, i;
+	uint64_t key;
+
+	for (;;) {
+		n = pread(index_fd, buffer, sizeof(buffer), loaded_size);
+		if (n < LINE_LENGTH)
+			return;
+
+		for (i = 0; i + LINE_LENGTH <= n; i += LINE_LENGTH) {
+			const char *line = buffer + i;
+
+			if (line[16] != ' ' || line[LINE_LENGTH - 1] != '\n')
+				continue;
+
+			memcpy(field, line, 16);
+			field[16] = '\0';
+			key = strtoull(field, NULL, 16);
+			memcpy(field, line + 17, 16);
+			if (key != 0)
+				set_entry(key, strtoull(field, NULL, 16));
+			line_count++;
+		}
+		loaded_size += i;
+	}
+}
+
+/**
+ * Append the state of a command to the index.
+ */
+static void append_entry(uint64_t key, uint64_t state)
+{
+	char line[LINE_LENGTH + 1];
+
+	snprintf(line, sizeof(line), "%016" PRIx64 " %016" PRIx64 "\n", key,
+			 state);
+	if (write_all(index_fd, line, LINE_LENGTH) != LINE_LENGTH)
+		perror("incremental");
+}
+
+/**
+ * Rewrite the index with one line per command still known.
+ */
+static void compact_index(const char *name)
+{
+	char tmp[PATH_MAX];
+	int fd;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", name);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1)
+		return;
+
+	close(index_fd);
+	index_fd = fd;
+	loaded_size = line_count = 0;
+	for (size_t i = 0; i < entry_size; i++)
+		if (entries[i].key != 0 && entries[i].state != 0) {
+			append_entry(entries[i].key, entries[i].state);
+			loaded_size += LINE_LENGTH;
+			line_count++;
+		}
+	close(fd);
+
+	rename(tmp, name);
+	index_fd = move_fd_high(open(name, O_RDWR | O_APPEND | O_CLOEXEC));
+	if (index_fd == -1)
+		perror("incremental");
+}
+
+/**
+ * Skip the commands that are up to date.
+ */
+int incremental_enable(const char *value)
+{
+	const char *name = value != NULL && *value != '\0' ? value : DEFAULT_INDEX;
+	int fd = move_fd_high(open(name, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC,
+							   0644));
+	size_t live = 0;
+
+	if (fd == -1) {
+		perror("incremental");
+		return -1;
+	}
+
+	incremental_disable();
+	index_fd = fd;
+	sync_index();
+
+	for (size_t i = 0; i < entry_size; i++)
+		if (entries[i].key != 0 && entries[i].state != 0)
+			live++;
+	if (line_count > 2 * live + COMPACT_SLACK)
+		compact_index(name);
+
+	return index_fd != -1 ? 0 : -1;
+}
+
+/**
+ * Run every command again.
+ */
+void incremental_disable(void)
+{
+	if (index_fd >= 0)
+		close(index_fd);
+	index_fd = -1;
+	loaded_size = line_count = 0;
+
+	free(entries);
+	entries = NULL;
+	entry_count = entry_size = 0;
+}
+
+/**
+ * Check if commands may be skipped.
+ */
+bool incremental_enabled(void)
+{
+	return index_fd >= 0;
+}
+
+/**
+ * Check if a command may be skipped at all: it writes to files and does
+ * not run in a pipe or in a group with redirections (its input or output
+ * would be missing).
+ */
+static bool is_eligible(simple_command_t *s)
+{
+	if (index_fd < 0 || (s->out == NULL && s->err == NULL))
+		return false;
+
+	for (command_t *c = s->up; c != NULL; c = c->up)
+		if (c->op == OP_PIPE || c->op == OP_FANOUT ||
+			((c->op == OP_BRACE_GROUP || c->op == OP_SUBSHELL) &&
+			 (c->scmd->in != NULL || c->scmd->out != NULL ||
+			  c->scmd->err != NULL || c->scmd->dup != NULL)))
+			return false;
+
+	return true;
+}
+
+/**
+ * Continue a hash with the names of a list of redirections.
+ */
+static uint64_t hash_words(uint64_t hash, const char *kind, word_t *w)
+{
+	hash = hash_string(hash, kind);
+	for (; w != NULL; w = w->next_word) {
+		char *name = get_word(w);
+
+		hash = hash_string(hash, name);
+		free(name);
+	}
+
+	return hash;
+}
+
+/**
+ * Identity of a command: where and how it runs, and its redirections.
+ */
+static uint64_t command_key(simple_command_t *s, char **argv)
+{
+	char cwd[PATH_MAX];
+	const char *path = getenv("PATH");
+	uint64_t hash = HASH_INIT;
+
+	hash = hash_string(hash, getcwd(cwd, sizeof(cwd)) != NULL ? cwd : "");
+	hash = hash_string(hash, path != NULL ? path : "");
+	for (; *argv != NULL; argv++)
+		hash = hash_string(hash, *argv);
+	hash = hash_words(hash, "<", s->in);
+	hash = hash_words(hash, ">", s->out);
+	hash = hash_words(hash, "2>", s->err);
+	for (dup_t *d = s->dup; d != NULL; d = d->next) {
+		hash = hash_bytes(hash, &d->fd, sizeof(d->fd));
+		hash = hash_bytes(hash, &d->source, sizeof(d->source));
+		hash = hash_bytes(hash, &d->before_files, sizeof(d->before_files));
+	}
+	hash = hash_bytes(hash, &s->io_flags, sizeof(s->io_flags));
+
+	return hash != 0 ? hash : 1;
+}
+
+/**
+ * Continue a hash with what tells whether a file changed: its inode, size
+ * and modification time, or only that it is not a regular file.
+ */
+static uint64_t hash_file(uint64_t hash, const char *name)
+{
+	struct stat st;
+	char present;
+
+	hash = hash_string(hash, name);
+	present = stat(name, &st) == 0 && S_ISREG(st.st_mode);
+	hash = hash_bytes(hash, &present, sizeof(present));
+	if (!present)
+		return hash;
+
+	hash = hash_bytes(hash, &st.st_dev, sizeof(st.st_dev));
+	hash = hash_bytes(hash, &st.st_ino, sizeof(st.st_ino));
+	hash = hash_bytes(hash, &st.st_size, sizeof(st.st_size));
+	hash = hash_bytes(hash, &st.st_mtim, sizeof(st.st_mtim));
+
+	return hash;
+}
+
+/**
+ * Continue a hash with the files of a list of redirections.
+ */
+static uint64_t hash_word_files(uint64_t hash, word_t *w)
+{
+	for (; w != NULL; w = w->next_word) {
+		char *name = get_word(w);
+
+		hash = hash_file(hash, name);
+		free(name);
+	}
+
+	return hash;
+}
+
+/**
+ * Continue a hash with the program a command runs, searched in PATH like
+ * execvp() does, so that rebuilding a tool runs its commands again.
+ */
+static uint64_t hash_program(uint64_t hash, const char *name)
+{
+	const char *dirs = getenv("PATH"), *end;
+	char path[PATH_MAX];
+
+	if (strchr(name, '/') != NULL || dirs == NULL)
+		return hash_file(hash, name);
+
+	for (;; dirs = end + 1) {
+		end = strchr(dirs, ':');
+		if (end == NULL)
+			end = dirs + strlen(dirs);
+
+		// An empty entry is the current directory
+		if (end == dirs)
+			snprintf(path, sizeof(path), "%s", name);
+		else
+			snprintf(path, sizeof(path), "%.*s/%s", (int)(end - dirs), dirs,
+					 name);
+		if (access(path, X_OK) == 0)
+			return hash_file(hash, path);
+
+		if (*end == '\0')
+			return hash_file(hash, name);
+	}
+}
+
+/**
+ * State of the files of a command: its program, inputs and outputs.
+ */
+static uint64_t command_state(simple_command_t *s, char **argv)
+{
+	uint64_t hash = hash_program(HASH_INIT, argv[0]);
+
+	for (argv++; *argv != NULL; argv++)
+		hash = hash_file(hash, *argv);
+	hash = hash_word_files(hash, s->in);
+	hash = hash_word_files(hash, s->out);
+	hash = hash_word_files(hash, s->err);
+
+	return hash != 0 ? hash : 1;
+}
+
+/**
+ * Check if every output of a command exists.
+ */
+static bool outputs_exist(word_t *w)
+{
+	struct stat st;
+
+	for (; w != NULL; w = w->next_word) {
+		char *name = get_word(w);
+		int ret = stat(name, &st);
+
+		free(name);
+		if (ret != 0)
+			return false;
+	}
+
+	return true;
+}
+
+/**
+ * Check if an external command is up to date.
+ */
+bool incremental_fresh(simple_command_t *s, char **argv)
+{
+	uint64_t state;
+
+	if (!is_eligible(s))
+		return false;
+
+	sync_index();
+	state = get_state(command_key(s, argv));
+
+	return state != 0 && outputs_exist(s->out) && outputs_exist(s->err) &&
+		   state == command_state(s, argv);
+}
+
+/**
+ * Remember the state an external command left.
+ */
+void incremental_record(simple_command_t *s, char **argv, int status)
+{
+	uint64_t key, state;
+
+	if (!is_eligible(s))
+		return;
+
+	key = command_key(s, argv);
+	state = status == 0 ? command_state(s, argv) : 0;
+	if (state == get_state(key))
+		return;
+
+	set_entry(key, state);
+	append_entry(key, state);
+}
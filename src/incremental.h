@@ -0,0 +1,40 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef _INCREMENTAL_H
+#define _INCREMENTAL_H
+
+#include "../util/parser/parser.h"
+
+/**
+ * Skip the commands that are up to date (set -o incremental[=index]). The
+ * state of the commands that ran is kept in the index file (by default
+ * .mini-shell-incremental in the current directory).
+ * Returns 0 on success and -1 if the index cannot be opened.
+ */
+int incremental_enable(const char *value);
+
+/**
+ * Run every command again (set +o incremental).
+ */
+void incremental_disable(void);
+
+/**
+ * Check if commands may be skipped.
+ */
+bool incremental_enabled(void);
+
+/**
+ * Check if an external command is up to date: it redirects its output to
+ * files that still exist, and neither the command, its program, its input
+ * files (< and the parameters naming files) nor its outputs changed since
+ * it last succeeded. Commands in a pipe are never up to date.
+ */
+bool incremental_fresh(simple_command_t *s, char **argv);
+
+/**
+ * Remember the state an external command left after it ran with the given
+ * exit status (a failed command is forgotten, so that it runs again).
+ */
+void incremental_record(simple_command_t *s, char **argv, int status);
+
+#endif /* _INCREMENTAL_H */
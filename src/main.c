@@ -1,12 +1,21 @@
 // SPDX-License-Identifier: BSD-3-Clause
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "../util/parser/parser.h"
 #include "cmd.h"
+#include "memo.h"
+#include "stats.h"
+#include "trace.h"
 #include "utils.h"
+#include "zygote.h"
 
 #define PROMPT             "> "
 #define CHUNK_SIZE         1024
@@ -18,9 +27,10 @@ void parse_error(const char *str, const int where)
 }
 
 /**
- * Readline from mini-shell.
+ * Readline from mini-shell. The line is followed by two NUL bytes, so that
+ * it can be scanned in place; *size counts both (see parse_line_buffer()).
  */
-static char *read_line(void)
+static char *read_line(size_t *size)
 {
 	char *line = NULL;
 	int line_length = 0;
@@ -47,7 +57,7 @@ static char *read_line(void)
 			endline = 1;
 		}
 
-		line = realloc(line, line_length + CHUNK_SIZE);
+		line = realloc(line, line_length + CHUNK_SIZE + 1);
 		DIE(line == NULL, "Error allocating command line");
 
 		line[line_length] = '\0';
@@ -56,41 +66,208 @@ static char *read_line(void)
 		line_length += CHUNK_SIZE;
 	}
 
+	if (line != NULL) {
+		*size = strlen(line) + 2;
+		line[*size - 1] = '\0';
+	}
+
 	return line;
 }
 
-static void start_shell(void)
+/**
+ * Parse and execute a single line, return its exit status. If buffer is
+ * not NULL, the line is scanned in place instead (see parse_line_buffer()).
+ */
+static int run_line(const char *line, char *buffer, size_t size)
+{
+	command_t *root = NULL;
+	uint64_t start;
+	int ret = 0;
+
+	start = stats_now();
+	if (buffer != NULL)
+		parse_line_buffer(buffer, size, &root);
+	else
+		parse_line(line, &root);
+	stats_record(STATS_PARSE, start);
+
+	if (root != NULL)
+		ret = parse_command(root, 0, NULL);
+
+	start = stats_now();
+	free_parse_memory();
+	stats_record(STATS_FREE, start);
+
+	return ret;
+}
+
+static int start_shell(void)
 {
 	char *line;
-	command_t *root;
+	size_t size;
+	uint64_t start;
 
-	int ret;
+	int ret = 0;
 
 	for (;;) {
 		printf(PROMPT);
 		fflush(stdout);
-		ret = 0;
 
-		root = NULL;
-		line = read_line();
+		start = stats_now();
+		line = read_line(&size);
+		stats_record(STATS_READ_LINE, start);
 		if (line == NULL)
-			return;
-		parse_line(line, &root);
+			return ret;
 
-		if (root != NULL)
-			ret = parse_command(root, 0, NULL);
-
-		free_parse_memory();
+		ret = run_line(NULL, line, size);
 		free(line);
 
 		if (ret == SHELL_EXIT)
 			break;
 	}
+
+	return ret;
+}
+
+/**
+ * Execute every line of a script held in memory (no prompt is printed),
+ * return the exit status of the last command.
+ *
+ * If in_place is true, the script must be writable and followed by two
+ * extra bytes; each line is then handed to the parser as a slice of the
+ * script, terminated by borrowing the end of line and the next byte.
+ */
+static int run_script(char *script, size_t size, bool in_place)
+{
+	char *end = script + size;
+	int ret = 0;
+
+	while (script < end) {
+		char *eol = memchr(script, '\n', end - script);
+		char *line_end = eol != NULL ? eol : end;
+		char *line, saved[2];
+
+		if (line_end > script && line_end[-1] == '\r')
+			line_end--;
+
+		if (in_place) {
+			saved[0] = line_end[0];
+			saved[1] = line_end[1];
+			line_end[0] = line_end[1] = '\0';
+			ret = run_line(NULL, script, line_end - script + 2);
+			line_end[0] = saved[0];
+			line_end[1] = saved[1];
+		} else if (eol == NULL && line_end == end) {
+			// The last line of a -c string is already terminated
+			ret = run_line(script, NULL, 0);
+		} else {
+			line = strndup(script, line_end - script);
+			DIE(line == NULL, "Error allocating command line");
+			ret = run_line(line, NULL, 0);
+			free(line);
+		}
+
+		if (ret == SHELL_EXIT)
+			break;
+		script = eol != NULL ? eol + 1 : end;
+	}
+
+	return ret;
+}
+
+/**
+ * Map a script file privately, followed by two zeroed bytes, so that its
+ * lines can be scanned in place without ever copying them.
+ */
+static char *map_script(int fd, size_t size)
+{
+	char *script;
+
+	// Reserve the extra bytes first, then map the file over the reservation
+	script = mmap(NULL, size + 2, PROT_READ | PROT_WRITE,
+				  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (script == MAP_FAILED)
+		return NULL;
+
+	if (mmap(script, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+			 fd, 0) == MAP_FAILED) {
+		munmap(script, size + 2);
+		return NULL;
+	}
+	madvise(script, size, MADV_SEQUENTIAL);
+
+	return script;
+}
+
+/**
+ * Execute a script file, mapped in memory instead of read through stdio.
+ */
+static int run_script_file(const char *path)
+{
+	struct stat st;
+	char *script;
+	int fd, ret;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		perror(path);
+		if (fd != -1)
+			close(fd);
+		return 127;
+	}
+
+	if (st.st_size == 0) {
+		close(fd);
+		return 0;
+	}
+
+	script = map_script(fd, st.st_size);
+	close(fd);
+	if (script == NULL) {
+		perror(path);
+		return 127;
+	}
+
+	ret = run_script(script, st.st_size, true);
+	munmap(script, st.st_size + 2);
+
+	return ret;
 }
 
-int main(void)
+/*
+ * Usage:
+ *   mini-shell                  - read commands from stdin, with a prompt
+ *   mini-shell -c line          - execute line and exit
+ *   mini-shell file [args...]   - execute the commands in file and exit
+ * The exit status is that of the last command.
+ * Extra arguments are accepted for compatibility with sh, but they are not
+ * expanded since the parser only knows named variables.
+ */
+int main(int argc, char *argv[])
 {
-	start_shell();
+	const char *trace_path = getenv("MINISHELL_TRACE");
+	const char *zygote = getenv("MINISHELL_ZYGOTE");
+	int ret;
+
+	// First, while the shell is as small as it gets
+	if (zygote != NULL && zygote[0] != '\0' && strcmp(zygote, "0") != 0)
+		zygote_start();
+
+	if (trace_path != NULL && trace_path[0] != '\0')
+		trace_open(trace_path);
+
+	if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+		if (argc < 3) {
+			fprintf(stderr, "%s: -c: option requires an argument\n", argv[0]);
+			return 2;
+		}
+		ret = run_script(argv[2], strlen(argv[2]), false);
+	} else if (argc > 1) {
+		ret = run_script_file(argv[1]);
+	} else {
+		memo_set_command_input(STDIN_FILENO);
+		ret = start_shell();
+	}
 
-	return EXIT_SUCCESS;
+	return shell_exit_status(ret);
 }
@@ -0,0 +1,413 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#define _GNU_SOURCE
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "copy.h"
+#include "hash.h"
+#include "memo.h"
+#include "timing.h"
+#include "utils.h"
+
+/* Cache used when MEMO_DIR is not set. */
+#define DEFAULT_DIR	".mini-shell-memo"
+
+/* Buffer used to hash the inputs. */
+#define BUFFER_SIZE	(128 * 1024)
+
+
+/* The file, pipe or terminal the shell reads its commands from. */
+static bool has_input;
+static dev_t input_dev;
+static ino_t input_ino;
+
+/* Commands that change the state of the shell, never replayed. */
+static const char * const shell_commands[] = {
+	"exit", "quit", "cd", "set", "shellstats", "memo",
+};
+
+/**
+ * Check if a command changes the state of the shell.
+ */
+static bool changes_shell(const char *verb)
+{
+	bool ret = strchr(verb, '=') != NULL;
+
+	for (size_t i = 0; !ret && i < sizeof(shell_commands) / sizeof(shell_commands[0]); i++)
+		ret = strcmp(verb, shell_commands[i]) == 0;
+
+	return ret;
+}
+
+/**
+ * Continue a hash with everything left in a descriptor, read from offset
+ * (without moving the file offset) or, if offset is -1, consumed. What is
+ * read is also written to copy, unless it is -1.
+ * Returns 0 on success and -1 on error.
+ */
+static int hash_contents(uint64_t *hash, int fd, off_t offset, int copy)
+{
+	char *buffer = malloc(BUFFER_SIZE);
+	ssize_t n;
+
+	DIE(buffer == NULL, "malloc");
+
+	for (;;) {
+		n = offset == -1 ? read(fd, buffer, BUFFER_SIZE) :
+			pread(fd, buffer, BUFFER_SIZE, offset);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+
+		*hash = hash_bytes(*hash, buffer, n);
+		if (copy != -1 && write_all(copy, buffer, n) != n) {
+			n = -1;
+			break;
+		}
+		if (offset != -1)
+			offset += n;
+	}
+
+	free(buffer);
+	return n == 0 ? 0 : -1;
+}
+
+/**
+ * Continue a hash with the contents of a parameter, if it names a regular
+ * file, so that a tool is not replayed after its input changed.
+ */
+static uint64_t hash_parameter(uint64_t hash, const char *name)
+{
+	struct stat st;
+	int fd;
+
+	hash = hash_string(hash, name);
+	if (stat(name, &st) != 0 || !S_ISREG(st.st_mode))
+		return hash;
+
+	fd = open(name, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return hash;
+
+	hash = hash_string(hash, "<file>");
+	if (hash_contents(&hash, fd, 0, -1) != 0)
+		perror(name);
+	close(fd);
+
+	return hash;
+}
+
+/**
+ * Continue a hash with the variables named in MEMO_ENV (separated by ':').
+ */
+static uint64_t hash_environment(uint64_t hash)
+{
+	const char *names = getenv("MEMO_ENV"), *end, *value;
+	char name[256];
+
+	for (; names != NULL && *names != '\0'; names = *end ? end + 1 : end) {
+		end = strchr(names, ':');
+		if (end == NULL)
+			end = names + strlen(names);
+		if (end == names || (size_t)(end - names) >= sizeof(name))
+			continue;
+
+		memcpy(name, names, end - names);
+		name[end - names] = '\0';
+		value = getenv(name);
+		hash = hash_string(hash, name);
+		hash = hash_string(hash, value != NULL ? value : "");
+	}
+
+	return hash;
+}
+
+/**
+ * Continue a hash with stdin. A file is read in place; a pipe or a socket
+ * is drained into an unlinked file in dir, which becomes stdin (the caller
+ * restores the descriptor). The shell's own command input, a script, is
+ * never hashed nor consumed: cmd gets /dev/null instead, and like other
+ * devices it counts as empty.
+ * Returns 0 on success and -1 if stdin cannot be hashed (a terminal, be it
+ * the one the shell reads its commands from).
+ */
+static int hash_stdin(uint64_t *hash, const char *dir)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	off_t offset;
+	int fd;
+
+	if (fstat(STDIN_FILENO, &st) != 0)
+		return -1;
+
+	if (has_input && st.st_dev == input_dev && st.st_ino == input_ino) {
+		if (isatty(STDIN_FILENO))
+			return -1;
+
+		fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+		if (fd == -1 || dup2(fd, STDIN_FILENO) == -1) {
+			perror("memo");
+			if (fd != -1)
+				close(fd);
+			return -1;
+		}
+		close(fd);
+		return 0;
+	}
+
+	if (S_ISREG(st.st_mode)) {
+		offset = lseek(STDIN_FILENO, 0, SEEK_CUR);
+		return hash_contents(hash, STDIN_FILENO, offset, -1);
+	}
+
+	if (S_ISCHR(st.st_mode))
+		return isatty(STDIN_FILENO) ? -1 : 0;
+
+	if (!S_ISFIFO(st.st_mode) && !S_ISSOCK(st.st_mode))
+		return -1;
+
+	snprintf(path, sizeof(path), "%s/stdin.XXXXXX", dir);
+	fd = mkostemp(path, O_CLOEXEC);
+	if (fd == -1) {
+		perror("memo");
+		return -1;
+	}
+	unlink(path);
+
+	if (hash_contents(hash, STDIN_FILENO, -1, fd) != 0 ||
+		lseek(fd, 0, SEEK_SET) != 0 || dup2(fd, STDIN_FILENO) == -1) {
+		perror("memo");
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+	return 0;
+}
+
+/**
+ * Run cmd, the command after the memo keyword, with the redirections the
+ * memo command already applied.
+ */
+static int run_command(simple_command_t *s, int level, command_t *father,
+					   memo_run_t run)
+{
+	word_t *memo = s->verb, *verb = s->params;
+	word_t *in = s->in, *out = s->out, *err = s->err;
+	dup_t *dup = s->dup;
+	int ret;
+
+	s->verb = verb;
+	s->params = verb->next_word;
+	verb->next_word = NULL;
+	s->in = s->out = s->err = NULL;
+	s->dup = NULL;
+
+	ret = run(s, level, father);
+
+	verb->next_word = s->params;
+	s->params = verb;
+	s->verb = memo;
+	s->in = in;
+	s->out = out;
+	s->err = err;
+	s->dup = dup;
+
+	return ret;
+}
+
+/**
+ * Replay a cache entry: its stdout, its stderr and its exit status.
+ * Returns false if the entry is not there.
+ */
+static bool replay(const char *entry, int *status)
+{
+	char path[PATH_MAX], buffer[16];
+	const char * const files[] = { "out", "err" };
+	ssize_t n;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/status", entry);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return false;
+	n = read(fd, buffer, sizeof(buffer) - 1);
+	close(fd);
+	if (n <= 0)
+		return false;
+	buffer[n] = '\0';
+	*status = atoi(buffer);
+
+	for (int i = 0; i < 2; i++) {
+		snprintf(path, sizeof(path), "%s/%s", entry, files[i]);
+		fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (fd == -1)
+			return false;
+		if (copy_fd(fd, i == 0 ? STDOUT_FILENO : STDERR_FILENO) != 0)
+			perror("memo");
+		close(fd);
+	}
+
+	return true;
+}
+
+/**
+ * Remove an entry that is not complete.
+ */
+static void remove_entry(const char *entry)
+{
+	char path[PATH_MAX];
+	const char * const files[] = { "out", "err", "status" };
+
+	for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+		snprintf(path, sizeof(path), "%s/%s", entry, files[i]);
+		unlink(path);
+	}
+	rmdir(entry);
+}
+
+/**
+ * Open a file of a cache entry being written.
+ */
+static int create_file(const char *entry, const char *name)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/%s", entry, name);
+	return open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+}
+
+/**
+ * Run cmd with its stdout and stderr also copied into a new entry, which
+ * replaces entry (atomically) once cmd is done.
+ */
+static int run_and_store(simple_command_t *s, int level, command_t *father,
+						 memo_run_t run, const char *entry)
+{
+	char tmp[PATH_MAX], line[16];
+	int files[2] = { -1, -1 }, saved[2] = { -1, -1 }, ends[2] = { -1, -1 };
+	pid_t pids[2] = { -1, -1 };
+	bool stored = true;
+	int status, ret, fd;
+
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", entry);
+	if (mkdtemp(tmp) == NULL) {
+		perror("memo");
+		return run_command(s, level, father, run);
+	}
+
+	for (int i = 0; i < 2 && stored; i++) {
+		files[i] = create_file(tmp, i == 0 ? "out" : "err");
+		saved[i] = fcntl(i == 0 ? STDOUT_FILENO : STDERR_FILENO,
+						 F_DUPFD_CLOEXEC, SHELL_FD_MIN);
+		if (files[i] != -1 && saved[i] != -1) {
+			int outs[] = { saved[i], files[i] };
+
+			ends[i] = start_tee(outs, 2, &pids[i]);
+		}
+		if (ends[i] == -1 ||
+			dup2(ends[i], i == 0 ? STDOUT_FILENO : STDERR_FILENO) == -1)
+			stored = false;
+		if (ends[i] != -1)
+			close(ends[i]);
+	}
+	if (!stored)
+		perror("memo");
+
+	ret = run_command(s, level, father, run);
+
+	// Closing the write ends lets the tees finish
+	for (int i = 0; i < 2; i++) {
+		if (saved[i] != -1) {
+			dup2(saved[i], i == 0 ? STDOUT_FILENO : STDERR_FILENO);
+			close(saved[i]);
+		}
+		if (pids[i] > 0) {
+			wait_child(pids[i], &status);
+			stored = stored && WEXITSTATUS(status) == 0;
+		}
+		if (files[i] != -1)
+			close(files[i]);
+	}
+
+	fd = create_file(tmp, "status");
+	if (fd != -1) {
+		snprintf(line, sizeof(line), "%d\n", ret);
+		stored = stored && write_all(fd, line, strlen(line)) ==
+						   (ssize_t)strlen(line);
+		close(fd);
+	}
+
+	// Another shell may have stored the same entry meanwhile
+	if (ret < 0 || fd == -1 || !stored || rename(tmp, entry) != 0)
+		remove_entry(tmp);
+
+	return ret;
+}
+
+/**
+ * Record the descriptor the shell reads its commands from.
+ */
+void memo_set_command_input(int fd)
+{
+	struct stat st;
+
+	if (fstat(fd, &st) == 0) {
+		input_dev = st.st_dev;
+		input_ino = st.st_ino;
+		has_input = true;
+	}
+}
+
+/**
+ * Run memo cmd args...
+ */
+int memo_run(simple_command_t *s, char **argv, int level, command_t *father,
+			 memo_run_t run)
+{
+	const char *dir = getenv("MEMO_DIR"), *path = getenv("PATH");
+	char cwd[PATH_MAX], entry[PATH_MAX];
+	uint64_t key = HASH_INIT;
+	int status;
+
+	if (dir == NULL || *dir == '\0')
+		dir = DEFAULT_DIR;
+
+	if (changes_shell(argv[0]))
+		return run_command(s, level, father, run);
+
+	if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+		perror("memo");
+		return run_command(s, level, father, run);
+	}
+
+	key = hash_string(key, getcwd(cwd, sizeof(cwd)) != NULL ? cwd : "");
+	key = hash_string(key, path != NULL ? path : "");
+	key = hash_environment(key);
+	key = hash_string(key, argv[0]);
+	for (char **param = argv + 1; *param != NULL; param++)
+		key = hash_parameter(key, *param);
+	key = hash_string(key, "<stdin>");
+	if (hash_stdin(&key, dir) != 0)
+		return run_command(s, level, father, run);
+
+	snprintf(entry, sizeof(entry), "%s/%016" PRIx64, dir, key);
+	if (replay(entry, &status))
+		return status;
+
+	return run_and_store(s, level, father, run, entry);
+}
@@ -0,0 +1,32 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef _MEMO_H
+#define _MEMO_H
+
+#include "../util/parser/parser.h"
+
+/* Run a simple command, returns its exit status. */
+typedef int (*memo_run_t)(simple_command_t *s, int level, command_t *father);
+
+/**
+ * Run the simple command `memo cmd args...` whose redirections are already
+ * applied, argv being the one of cmd. The output of cmd is cached by what
+ * it depends on: argv, the working directory, PATH and the variables
+ * listed in MEMO_ENV, the contents of stdin and of the parameters naming
+ * files. If stdin is the script the shell reads its commands from, cmd runs
+ * with /dev/null instead, so that memo never consumes the next commands; if
+ * stdin is a terminal, cmd is not memoized and reads it. A hit replays the
+ * cached stdout, stderr and exit status; a miss runs cmd through run and
+ * stores them. The cache is the directory MEMO_DIR (by default
+ * .mini-shell-memo in the current directory).
+ * Returns the exit status of cmd.
+ */
+int memo_run(simple_command_t *s, char **argv, int level, command_t *father,
+			 memo_run_t run);
+
+/**
+ * Tell memo that the shell reads its commands from fd.
+ */
+void memo_set_command_input(int fd);
+
+#endif /* _MEMO_H */
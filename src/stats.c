@@ -0,0 +1,141 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+
+/*
+ * Log-linear (HDR style) histogram: values below 2^SUB_BITS get their own
+ * bucket, larger values are split into 2^SUB_BITS buckets per power of two,
+ * which bounds the relative error of a percentile to about 6%.
+ */
+#define SUB_BITS	4
+#define SUB_BUCKETS	(1 << SUB_BITS)
+#define BUCKETS		(64 * SUB_BUCKETS)
+
+struct histogram {
+	uint32_t counts[BUCKETS];
+	uint64_t total;
+	uint64_t max;
+};
+
+static struct histogram histograms[STATS_PHASES];
+
+static const char * const phase_names[STATS_PHASES] = {
+	[STATS_READ_LINE] = "read_line",
+	[STATS_PARSE] = "parse_line",
+	[STATS_EXPAND] = "expand",
+	[STATS_REDIRECT] = "redirect",
+	[STATS_SPAWN] = "spawn",
+	[STATS_WAIT] = "wait",
+	[STATS_RESTORE] = "fd_restore",
+	[STATS_FREE] = "free_parse",
+};
+
+/**
+ * Current monotonic time in nanoseconds.
+ */
+uint64_t stats_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Bucket holding a value.
+ */
+static int bucket_index(uint64_t value)
+{
+	int shift;
+
+	if (value < SUB_BUCKETS)
+		return value;
+
+	shift = 63 - __builtin_clzll(value) - SUB_BITS;
+	return (shift + 1) * SUB_BUCKETS + ((value >> shift) & (SUB_BUCKETS - 1));
+}
+
+/**
+ * Value in the middle of a bucket.
+ */
+static uint64_t bucket_value(int index)
+{
+	int shift;
+	uint64_t low;
+
+	if (index < SUB_BUCKETS)
+		return index;
+
+	shift = index / SUB_BUCKETS - 1;
+	low = (uint64_t)(SUB_BUCKETS + index % SUB_BUCKETS) << shift;
+	return low + ((1ULL << shift) >> 1);
+}
+
+/**
+ * Record the time elapsed since start for a phase.
+ */
+void stats_record(enum stats_phase phase, uint64_t start)
+{
+	struct histogram *h = &histograms[phase];
+	uint64_t value = stats_now() - start;
+
+	h->counts[bucket_index(value)]++;
+	h->total++;
+	if (value > h->max)
+		h->max = value;
+}
+
+/**
+ * Smallest recorded value such that a given fraction of samples is below it.
+ */
+static uint64_t percentile(struct histogram *h, double fraction)
+{
+	uint64_t rank = (uint64_t)(fraction * h->total + 0.5), seen = 0;
+
+	if (rank == 0)
+		rank = 1;
+
+	for (int i = 0; i < BUCKETS; i++) {
+		seen += h->counts[i];
+		if (seen >= rank)
+			return bucket_value(i) < h->max ? bucket_value(i) : h->max;
+	}
+
+	return h->max;
+}
+
+/**
+ * Print the latency of every phase.
+ */
+void stats_print(void)
+{
+	printf("%-12s %10s %12s %12s %12s\n", "phase", "count",
+		   "p50(us)", "p99(us)", "max(us)");
+
+	for (int i = 0; i < STATS_PHASES; i++) {
+		struct histogram *h = &histograms[i];
+
+		if (h->total == 0) {
+			printf("%-12s %10d %12s %12s %12s\n", phase_names[i], 0,
+				   "-", "-", "-");
+			continue;
+		}
+
+		printf("%-12s %10llu %12.1f %12.1f %12.1f\n", phase_names[i],
+			   (unsigned long long)h->total, percentile(h, 0.5) / 1e3,
+			   percentile(h, 0.99) / 1e3, h->max / 1e3);
+	}
+	fflush(stdout);
+}
+
+/**
+ * Clear all histograms.
+ */
+void stats_reset(void)
+{
+	memset(histograms, 0, sizeof(histograms));
+}
@@ -0,0 +1,41 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <stdint.h>
+
+/* Phases of the shell's own work around each command. */
+enum stats_phase {
+	STATS_READ_LINE,
+	STATS_PARSE,
+	STATS_EXPAND,
+	STATS_REDIRECT,
+	STATS_SPAWN,
+	STATS_WAIT,
+	STATS_RESTORE,
+	STATS_FREE,
+	STATS_PHASES
+};
+
+/**
+ * Current monotonic time in nanoseconds.
+ */
+uint64_t stats_now(void);
+
+/**
+ * Record the time elapsed since start (from stats_now()) for a phase.
+ */
+void stats_record(enum stats_phase phase, uint64_t start);
+
+/**
+ * Print count, p50, p99 and max latency of every phase to stdout.
+ */
+void stats_print(void);
+
+/**
+ * Clear all histograms.
+ */
+void stats_reset(void);
+
+#endif /* _STATS_H */
@@ -0,0 +1,202 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "timing.h"
+#include "utils.h"
+#include "zygote.h"
+
+/* Resource usage of every child reaped so far by this process. */
+static struct timeval children_utime;
+static struct timeval children_stime;
+static long children_maxrss;
+
+/**
+ * Wait for a child process and account its resource usage.
+ */
+pid_t wait_child(pid_t pid, int *status)
+{
+	struct rusage usage;
+	// Commands of the spawn server are not children of the shell
+	pid_t ret = pid > 0 ? zygote_wait(pid, status, &usage) : 0;
+
+	if (ret == 0)
+		ret = wait4(pid, status, 0, &usage);
+
+	if (ret <= 0)
+		return ret;
+
+	timeradd(&children_utime, &usage.ru_utime, &children_utime);
+	timeradd(&children_stime, &usage.ru_stime, &children_stime);
+	if (usage.ru_maxrss > children_maxrss)
+		children_maxrss = usage.ru_maxrss;
+
+	return ret;
+}
+
+/**
+ * Check if a word is equal to the given string.
+ */
+static bool word_is(word_t *w, const char *str)
+{
+	char *word = get_word(w);
+	bool ret = word != NULL && strcmp(word, str) == 0;
+
+	free(word);
+	return ret;
+}
+
+/**
+ * Get the report format chosen by the first parameter of the time keyword.
+ */
+static int time_option(word_t *param)
+{
+	if (param != NULL && word_is(param, "-p"))
+		return TIME_FORMAT_POSIX;
+	if (param != NULL && word_is(param, "-j"))
+		return TIME_FORMAT_JSON;
+
+	return TIME_FORMAT_BASH;
+}
+
+/**
+ * Remove a leading time keyword from the command.
+ */
+bool time_strip_keyword(command_t *c, int *format)
+{
+	simple_command_t *s;
+	word_t *verb;
+
+	if (c == NULL)
+		return false;
+
+	// The keyword is the verb of the leftmost simple command, outside groups
+	while (c->op != OP_NONE) {
+		if (c->op == OP_BRACE_GROUP || c->op == OP_SUBSHELL)
+			return false;
+		c = c->cmd1;
+	}
+	s = c->scmd;
+
+	if (!word_is(s->verb, "time") || s->params == NULL)
+		return false;
+
+	*format = time_option(s->params);
+	verb = s->params;
+	if (*format != TIME_FORMAT_BASH)
+		verb = verb->next_word;
+
+	// Nothing to time, left to time_nothing
+	if (verb == NULL)
+		return false;
+
+	// First remaining parameter becomes the command
+	s->verb = verb;
+	s->params = verb->next_word;
+	verb->next_word = NULL;
+
+	return true;
+}
+
+/**
+ * Start measuring a command.
+ */
+void time_frame_begin(time_frame_t *frame, int format)
+{
+	frame->format = format;
+	frame->children_utime = children_utime;
+	frame->children_stime = children_stime;
+	frame->saved_maxrss = children_maxrss;
+	children_maxrss = 0;
+
+	getrusage(RUSAGE_SELF, &frame->self);
+	clock_gettime(CLOCK_MONOTONIC, &frame->start);
+}
+
+/**
+ * Convert a timeval to seconds.
+ */
+static double tv_seconds(struct timeval *tv)
+{
+	return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+/**
+ * Print a duration the way bash does (e.g. 0m1.234s).
+ */
+static void print_bash_time(const char *name, double seconds)
+{
+	long msec = (long)(seconds * 1000 + 0.5);
+
+	fprintf(stderr, "%s\t%ldm%ld.%03lds\n", name,
+			msec / 60000, msec / 1000 % 60, msec % 1000);
+}
+
+/**
+ * Stop measuring a command and print the summary.
+ */
+void time_frame_end(time_frame_t *frame, int status)
+{
+	struct timespec end;
+	struct rusage self;
+	struct timeval utime, stime, tmp;
+	double real;
+	long maxrss = children_maxrss;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	getrusage(RUSAGE_SELF, &self);
+
+	// Time spent by the shell itself plus every child reaped meanwhile
+	timersub(&self.ru_utime, &frame->self.ru_utime, &utime);
+	timersub(&children_utime, &frame->children_utime, &tmp);
+	timeradd(&utime, &tmp, &utime);
+	timersub(&self.ru_stime, &frame->self.ru_stime, &stime);
+	timersub(&children_stime, &frame->children_stime, &tmp);
+	timeradd(&stime, &tmp, &stime);
+
+	real = (end.tv_sec - frame->start.tv_sec) +
+		   (end.tv_nsec - frame->start.tv_nsec) / 1e9;
+
+	if (frame->saved_maxrss > children_maxrss)
+		children_maxrss = frame->saved_maxrss;
+
+	switch (frame->format) {
+	case TIME_FORMAT_POSIX:
+		fprintf(stderr, "real %.2f\nuser %.2f\nsys %.2f\n",
+				real, tv_seconds(&utime), tv_seconds(&stime));
+		break;
+
+	case TIME_FORMAT_JSON:
+		fprintf(stderr, "{\"real\":%.6f,\"user\":%.6f,\"sys\":%.6f,"
+				"\"maxrss_kb\":%ld,\"status\":%d}\n",
+				real, tv_seconds(&utime), tv_seconds(&stime), maxrss, status);
+		break;
+
+	default:
+		fprintf(stderr, "\n");
+		print_bash_time("real", real);
+		print_bash_time("user", tv_seconds(&utime));
+		print_bash_time("sys", tv_seconds(&stime));
+		break;
+	}
+	fflush(stderr);
+}
+
+/**
+ * Time an empty command.
+ */
+int time_nothing(word_t *params)
+{
+	time_frame_t frame;
+
+	time_frame_begin(&frame, time_option(params));
+	time_frame_end(&frame, 0);
+
+	return 0;
+}
@@ -0,0 +1,58 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef _TIMING_H
+#define _TIMING_H
+
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "../util/parser/parser.h"
+
+/* Report formats understood by the time keyword. */
+#define TIME_FORMAT_BASH	0
+#define TIME_FORMAT_POSIX	1
+#define TIME_FORMAT_JSON	2
+
+/**
+ * Resource usage snapshot taken when a timed command starts.
+ */
+typedef struct {
+	struct timespec start;
+	struct rusage self;
+	struct timeval children_utime;
+	struct timeval children_stime;
+	long saved_maxrss;
+	int format;
+} time_frame_t;
+
+/**
+ * Wait for a child process and account its resource usage (wait4) to the
+ * time frames that are currently running.
+ */
+pid_t wait_child(pid_t pid, int *status);
+
+/**
+ * Remove a leading `time [-p|-j]` keyword from the pipeline or and-or list
+ * rooted at c. Returns true and sets format if the keyword was found and a
+ * command follows it.
+ */
+bool time_strip_keyword(command_t *c, int *format);
+
+/**
+ * Run the time keyword without a command (`time`, `time -p`): report the
+ * resource usage of nothing, as bash does. Returns 0.
+ */
+int time_nothing(word_t *params);
+
+/**
+ * Start measuring a command.
+ */
+void time_frame_begin(time_frame_t *frame, int format);
+
+/**
+ * Stop measuring a command and print the summary to stderr.
+ */
+void time_frame_end(time_frame_t *frame, int status);
+
+#endif /* _TIMING_H */
@@ -0,0 +1,274 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "utils.h"
+
+#define TRACE_LINE_SIZE 4096
+
+/* Room kept at the end of a line for the characters closing it. */
+#define TRACE_LINE_RESERVE 16
+
+/* Longest event name, in bytes of the command name. */
+#define TRACE_NAME_MAX 256
+
+/* Trace output file, -1 when tracing is disabled. */
+static int trace_fd = -1;
+
+/**
+ * Event being formatted; it is written with a single write(), so lines
+ * coming from different processes do not interleave. Once something does
+ * not fit, the line is full and only its closing characters are added.
+ */
+struct trace_line {
+	char data[TRACE_LINE_SIZE];
+	size_t len;
+	bool full;
+};
+
+static const char * const op_names[] = {
+	[OP_NONE] = "simple",
+	[OP_SEQUENTIAL] = "sequential",
+	[OP_PARALLEL] = "parallel",
+	[OP_CONDITIONAL_ZERO] = "and",
+	[OP_CONDITIONAL_NZERO] = "or",
+	[OP_PIPE] = "pipe",
+	[OP_BRACE_GROUP] = "group",
+	[OP_SUBSHELL] = "subshell",
+	[OP_FANOUT] = "fanout",
+};
+
+/**
+ * Start writing trace events to a file.
+ */
+int trace_open(const char *path)
+{
+	trace_close();
+
+	trace_fd = move_fd_high(open(path, O_WRONLY | O_CREAT | O_TRUNC |
+									 O_APPEND | O_CLOEXEC, 0644));
+	if (trace_fd == -1) {
+		perror("trace");
+		return -1;
+	}
+
+	// The closing bracket is optional in the JSON array format
+	if (write(trace_fd, "[\n", 2) != 2) {
+		perror("trace");
+		trace_close();
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Stop tracing.
+ */
+void trace_close(void)
+{
+	if (trace_fd < 0)
+		return;
+
+	close(trace_fd);
+	trace_fd = -1;
+}
+
+/**
+ * Append formatted text to a trace line, entirely or not at all (the line
+ * is then full), keeping TRACE_LINE_RESERVE bytes free.
+ */
+static void line_printf(struct trace_line *line, const char *format, ...)
+{
+	size_t room = sizeof(line->data) - TRACE_LINE_RESERVE;
+	va_list args;
+	int ret;
+
+	if (line->full || line->len >= room) {
+		line->full = true;
+		return;
+	}
+
+	va_start(args, format);
+	ret = vsnprintf(line->data + line->len, room - line->len, format, args);
+	va_end(args);
+
+	if (ret < 0 || (size_t)ret >= room - line->len)
+		line->full = true;
+	else
+		line->len += ret;
+}
+
+/**
+ * Append closing characters to a trace line, using the reserved room.
+ */
+static void line_close(struct trace_line *line, const char *str)
+{
+	size_t len = strlen(str);
+
+	if (line->len + len <= sizeof(line->data)) {
+		memcpy(line->data + line->len, str, len);
+		line->len += len;
+	}
+}
+
+/**
+ * Append a JSON string literal with at most max bytes of str to a trace
+ * line (not cutting a UTF-8 sequence). If the line gets full meanwhile, the
+ * literal is not closed and the caller removes it.
+ */
+static void line_string(struct trace_line *line, const char *str, size_t max)
+{
+	size_t len = str != NULL ? strnlen(str, max) : 0;
+
+	while (len > 0 && str[len] != '\0' && (str[len] & 0xc0) == 0x80)
+		len--;
+
+	line_printf(line, "\"");
+	for (size_t i = 0; i < len; i++) {
+		if (str[i] == '"' || str[i] == '\\')
+			line_printf(line, "\\%c", str[i]);
+		else if ((unsigned char)str[i] < 0x20)
+			line_printf(line, "\\u%04x", str[i]);
+		else
+			line_printf(line, "%c", str[i]);
+	}
+	line_printf(line, "\"");
+}
+
+/**
+ * Start an event; the caller appends members to args and ends it.
+ */
+static void line_begin(struct trace_line *line, char phase, const char *name,
+					   int level)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	line->len = 0;
+	line->full = false;
+	line_printf(line, "{\"name\":");
+	line_string(line, name, TRACE_NAME_MAX);
+	line_printf(line, ",\"cat\":\"mini-shell\",\"ph\":\"%c\",\"ts\":%.3f,"
+				"\"pid\":%d,\"tid\":%d,\"args\":{\"level\":%d",
+				phase, now.tv_sec * 1e6 + now.tv_nsec / 1e3,
+				getpid(), getpid(), level);
+}
+
+/**
+ * Finish an event and write it to the trace file.
+ */
+static void line_end(struct trace_line *line)
+{
+	line_close(line, "}},\n");
+
+	if (write(trace_fd, line->data, line->len) < 0)
+		trace_close();
+}
+
+/**
+ * Append a redirection of a simple command.
+ */
+static void line_redirect(struct trace_line *line, const char *name,
+						  word_t *w)
+{
+	size_t len = line->len;
+	char *file;
+
+	if (w == NULL)
+		return;
+
+	file = get_word(w);
+	line_printf(line, ",\"%s\":", name);
+	line_string(line, file, SIZE_MAX);
+	free(file);
+
+	// Drop the whole member if it does not fit
+	if (line->full)
+		line->len = len;
+}
+
+/**
+ * Emit an event for a command tree node.
+ */
+void trace_command(char phase, command_t *c, int level, int status)
+{
+	struct trace_line line;
+
+	if (trace_fd < 0)
+		return;
+
+	line_begin(&line, phase, op_names[c->op], level);
+	line_printf(&line, ",\"op\":\"%s\"", op_names[c->op]);
+	if (phase == TRACE_END)
+		line_printf(&line, ",\"status\":%d", status);
+	line_end(&line);
+}
+
+/**
+ * Emit an event for a simple command.
+ */
+void trace_simple(char phase, simple_command_t *s, char **argv, int level,
+				  pid_t pid, int status)
+{
+	struct trace_line line;
+
+	if (trace_fd < 0)
+		return;
+
+	line_begin(&line, phase, argv != NULL ? argv[0] : "", level);
+	if (phase != TRACE_END) {
+		line_printf(&line, ",\"argv\":[");
+		for (int i = 0; !line.full && argv[i] != NULL; i++) {
+			size_t len = line.len;
+
+			if (i > 0)
+				line_printf(&line, ",");
+			line_string(&line, argv[i], SIZE_MAX);
+
+			// Elide the parameters that do not fit
+			if (line.full) {
+				line.len = len;
+				line_close(&line, i > 0 ? ",\"...\"" : "\"...\"");
+			}
+		}
+		line_close(&line, "]");
+		line_redirect(&line, "stdin", s->in);
+		line_redirect(&line, "stdout", s->out);
+		line_redirect(&line, "stderr", s->err);
+	} else {
+		if (pid > 0)
+			line_printf(&line, ",\"child\":%d", pid);
+		line_printf(&line, ",\"status\":%d", status);
+	}
+	line_end(&line);
+}
+
+/**
+ * Emit an event for a fork of two children.
+ */
+void trace_fork(char phase, const char *name, int level, int *fds,
+				pid_t pid1, pid_t pid2, int status)
+{
+	struct trace_line line;
+
+	if (trace_fd < 0)
+		return;
+
+	line_begin(&line, phase, name, level);
+	if (fds != NULL)
+		line_printf(&line, ",\"fds\":[%d,%d]", fds[0], fds[1]);
+	if (phase == TRACE_END)
+		line_printf(&line, ",\"children\":[%d,%d],\"status\":%d",
+					pid1, pid2, status);
+	line_end(&line);
+}
@@ -0,0 +1,44 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <sys/types.h>
+
+#include "../util/parser/parser.h"
+
+/* Chrome trace event phases. */
+#define TRACE_BEGIN	'B'
+#define TRACE_END	'E'
+#define TRACE_INSTANT	'i'
+
+/**
+ * Start writing trace events to path (Chrome trace / Perfetto JSON array).
+ * Returns 0 on success and -1 on error.
+ */
+int trace_open(const char *path);
+
+/**
+ * Stop tracing.
+ */
+void trace_close(void);
+
+/**
+ * Emit an event for a command tree node.
+ */
+void trace_command(char phase, command_t *c, int level, int status);
+
+/**
+ * Emit an event for a simple command; pid is the spawned child (or 0).
+ */
+void trace_simple(char phase, simple_command_t *s, char **argv, int level,
+				  pid_t pid, int status);
+
+/**
+ * Emit an event for a fork of two children (pipe or parallel); fds holds
+ * the pipe ends, if any.
+ */
+void trace_fork(char phase, const char *name, int level, int *fds,
+				pid_t pid1, pid_t pid2, int status);
+
+#endif /* _TRACE_H */
@@ -0,0 +1,414 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "uring.h"
+#include "utils.h"
+
+/* Submission queue size, also the most files opened by one group. */
+#define RING_ENTRIES	256
+
+/* Submission and completion rings shared with the kernel. */
+struct ring {
+	int fd;
+	pid_t owner;
+
+	void *sq_ptr, *cq_ptr;
+	size_t sq_size, cq_size;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+};
+
+/* A redirection file opened in advance. */
+struct preopen {
+	simple_command_t *stage;
+	word_t *word;
+	char *path;
+	int flags;
+	int fd;
+};
+
+static bool enabled;
+static struct ring ring = { .fd = -1 };
+
+static struct preopen *preopens;
+static size_t preopen_count, preopen_size;
+
+/**
+ * Unmap the rings and close the io_uring instance.
+ */
+static void ring_exit(void)
+{
+	if (ring.fd < 0)
+		return;
+
+	munmap(ring.sqes, RING_ENTRIES * sizeof(struct io_uring_sqe));
+	if (ring.cq_ptr != ring.sq_ptr)
+		munmap(ring.cq_ptr, ring.cq_size);
+	munmap(ring.sq_ptr, ring.sq_size);
+	close(ring.fd);
+	ring.fd = -1;
+}
+
+/**
+ * Check that the kernel supports the operations the engine submits: the
+ * first kernels with io_uring (5.1 to 5.5) have neither OPENAT nor CLOSE,
+ * nor the probe itself.
+ */
+static bool ring_probe(void)
+{
+	const unsigned int ops[] = { IORING_OP_OPENAT, IORING_OP_CLOSE };
+	struct io_uring_probe *probe;
+	bool ret;
+
+	probe = calloc(1, sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op));
+	DIE(probe == NULL, "calloc");
+
+	ret = syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PROBE,
+				  probe, 256) == 0;
+	for (size_t i = 0; ret && i < sizeof(ops) / sizeof(ops[0]); i++)
+		ret = ops[i] <= probe->last_op &&
+			  (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+
+	free(probe);
+	return ret;
+}
+
+/**
+ * Set up an io_uring instance; returns 0 on success and -1 on error.
+ */
+static int ring_init(void)
+{
+	struct io_uring_params params;
+	void *sqes;
+
+	memset(&params, 0, sizeof(params));
+	ring.fd = move_fd_high(syscall(__NR_io_uring_setup, RING_ENTRIES, &params));
+	if (ring.fd < 0)
+		return -1;
+
+	ring.owner = getpid();
+	ring.sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	ring.cq_size = params.cq_off.cqes +
+				   params.cq_entries * sizeof(struct io_uring_cqe);
+
+	// Kernels with a single mapping put both rings in the same area
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring.cq_size > ring.sq_size)
+			ring.sq_size = ring.cq_size;
+		ring.cq_size = ring.sq_size;
+	}
+
+	ring.sq_ptr = mmap(NULL, ring.sq_size, PROT_READ | PROT_WRITE,
+					   MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+	if (ring.sq_ptr == MAP_FAILED) {
+		close(ring.fd);
+		ring.fd = -1;
+		return -1;
+	}
+
+	ring.cq_ptr = ring.sq_ptr;
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+		ring.cq_ptr = mmap(NULL, ring.cq_size, PROT_READ | PROT_WRITE,
+						   MAP_SHARED | MAP_POPULATE, ring.fd,
+						   IORING_OFF_CQ_RING);
+		if (ring.cq_ptr == MAP_FAILED) {
+			munmap(ring.sq_ptr, ring.sq_size);
+			close(ring.fd);
+			ring.fd = -1;
+			return -1;
+		}
+	}
+
+	sqes = mmap(NULL, RING_ENTRIES * sizeof(struct io_uring_sqe),
+				PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd,
+				IORING_OFF_SQES);
+	if (sqes == MAP_FAILED) {
+		ring.sqes = NULL;
+		if (ring.cq_ptr != ring.sq_ptr)
+			munmap(ring.cq_ptr, ring.cq_size);
+		munmap(ring.sq_ptr, ring.sq_size);
+		close(ring.fd);
+		ring.fd = -1;
+		return -1;
+	}
+	ring.sqes = sqes;
+
+	ring.sq_head = (unsigned int *)((char *)ring.sq_ptr + params.sq_off.head);
+	ring.sq_tail = (unsigned int *)((char *)ring.sq_ptr + params.sq_off.tail);
+	ring.sq_mask = (unsigned int *)((char *)ring.sq_ptr + params.sq_off.ring_mask);
+	ring.sq_array = (unsigned int *)((char *)ring.sq_ptr + params.sq_off.array);
+	ring.cq_head = (unsigned int *)((char *)ring.cq_ptr + params.cq_off.head);
+	ring.cq_tail = (unsigned int *)((char *)ring.cq_ptr + params.cq_off.tail);
+	ring.cq_mask = (unsigned int *)((char *)ring.cq_ptr + params.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *)((char *)ring.cq_ptr + params.cq_off.cqes);
+
+	if (!ring_probe()) {
+		ring_exit();
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Get the ring of this process. A forked child must not share the rings
+ * of its parent, so it drops them and sets up its own.
+ */
+static bool ring_get(void)
+{
+	if (ring.fd >= 0 && ring.owner != getpid())
+		ring_exit();
+	if (ring.fd < 0 && ring_init() != 0)
+		return false;
+
+	return true;
+}
+
+/**
+ * Queue an operation; user_data is the index of its result.
+ */
+static struct io_uring_sqe *ring_queue(unsigned int index)
+{
+	unsigned int tail = *ring.sq_tail, slot = tail & *ring.sq_mask;
+	struct io_uring_sqe *sqe = &ring.sqes[slot];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = index;
+	ring.sq_array[slot] = slot;
+	__atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	return sqe;
+}
+
+/**
+ * Submit the queued operations and wait for all of them; results[i] gets
+ * the result of the operation with user_data i.
+ * Returns 0 on success and -1 if the submission failed.
+ */
+static int ring_submit(unsigned int count, int *results)
+{
+	unsigned int done = 0;
+	int ret;
+
+	do {
+		ret = syscall(__NR_io_uring_enter, ring.fd, count, count,
+					  IORING_ENTER_GETEVENTS, NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		return -1;
+
+	while (done < count) {
+		unsigned int head = *ring.cq_head;
+
+		if (head == __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+			syscall(__NR_io_uring_enter, ring.fd, 0, 1,
+					IORING_ENTER_GETEVENTS, NULL, 0);
+			continue;
+		}
+
+		struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+
+		results[cqe->user_data] = cqe->res;
+		__atomic_store_n(ring.cq_head, head + 1, __ATOMIC_RELEASE);
+		done++;
+	}
+
+	return 0;
+}
+
+/**
+ * Remember a redirection file of a stage.
+ */
+static void add_preopen(simple_command_t *s, word_t *w, int flags)
+{
+	if (preopen_count == preopen_size) {
+		preopen_size = preopen_size ? 2 * preopen_size : 16;
+		preopens = realloc(preopens, preopen_size * sizeof(*preopens));
+		DIE(preopens == NULL, "realloc");
+	}
+
+	preopens[preopen_count++] = (struct preopen) {
+		.stage = s,
+		.word = w,
+		.path = get_word(w),
+		.flags = flags | O_CLOEXEC,
+		.fd = -ECANCELED,
+	};
+}
+
+/**
+ * Collect the redirections of the stages that run unconditionally (the
+ * simple commands under pipe and parallel operators), in the order the
+ * shell opens them.
+ */
+static void collect_redirections(command_t *c)
+{
+	simple_command_t *s;
+
+	if (c->op == OP_PIPE || c->op == OP_PARALLEL) {
+		collect_redirections(c->cmd1);
+		collect_redirections(c->cmd2);
+		return;
+	}
+	if (c->op != OP_NONE)
+		return;
+
+	s = c->scmd;
+	if (s->in != NULL)
+		add_preopen(s, s->in, O_RDONLY);
+
+	if (s->out != NULL && s->out == s->err) {
+		add_preopen(s, s->out, O_WRONLY | O_CREAT | O_TRUNC);
+		return;
+	}
+	if (s->err != NULL)
+		add_preopen(s, s->err, O_WRONLY | O_CREAT |
+					((s->io_flags & IO_ERR_APPEND) ? O_APPEND : O_TRUNC));
+	if (s->out != NULL)
+		add_preopen(s, s->out, O_WRONLY | O_CREAT |
+					((s->io_flags & IO_OUT_APPEND) ? O_APPEND : O_TRUNC));
+}
+
+/**
+ * Forget the redirections of the group.
+ */
+static void clear_preopens(void)
+{
+	for (size_t i = 0; i < preopen_count; i++)
+		free(preopens[i].path);
+	preopen_count = 0;
+}
+
+/**
+ * Open the redirection files of a pipe / parallel group in one submission.
+ */
+bool uring_open_redirections(command_t *c)
+{
+	int results[RING_ENTRIES];
+
+	if (!enabled)
+		return false;
+
+	// A child starting its own group no longer needs the files of its parent
+	if (preopen_count > 0)
+		uring_close_redirections();
+
+	collect_redirections(c);
+	if (preopen_count == 0 || preopen_count > RING_ENTRIES || !ring_get()) {
+		clear_preopens();
+		return false;
+	}
+
+	for (size_t i = 0; i < preopen_count; i++) {
+		struct io_uring_sqe *sqe = ring_queue(i);
+
+		sqe->opcode = IORING_OP_OPENAT;
+		sqe->fd = AT_FDCWD;
+		sqe->addr = (unsigned long)preopens[i].path;
+		sqe->open_flags = preopens[i].flags;
+		sqe->len = 0644;
+
+		// The files of a stage are linked, so like with open() a failure
+		// leaves the following ones of the stage untouched
+		if (i + 1 < preopen_count && preopens[i + 1].stage == preopens[i].stage)
+			sqe->flags |= IOSQE_IO_LINK;
+	}
+
+	if (ring_submit(preopen_count, results) != 0) {
+		clear_preopens();
+		return false;
+	}
+
+	for (size_t i = 0; i < preopen_count; i++)
+		preopens[i].fd = results[i];
+
+	return true;
+}
+
+/**
+ * Take the descriptor opened in advance for a redirection word.
+ */
+bool uring_take(word_t *w, int *fd)
+{
+	for (size_t i = 0; i < preopen_count; i++) {
+		if (preopens[i].word != w)
+			continue;
+
+		*fd = preopens[i].fd;
+		preopens[i].fd = -ECANCELED;
+		return true;
+	}
+
+	return false;
+}
+
+/**
+ * Close the descriptors of the group that were not taken, in one
+ * submission when possible.
+ */
+void uring_close_redirections(void)
+{
+	int results[RING_ENTRIES];
+	unsigned int count = 0;
+
+	if (ring_get()) {
+		for (size_t i = 0; i < preopen_count; i++) {
+			results[i] = -ECANCELED;
+			if (preopens[i].fd < 0)
+				continue;
+
+			struct io_uring_sqe *sqe = ring_queue(i);
+
+			sqe->opcode = IORING_OP_CLOSE;
+			sqe->fd = preopens[i].fd;
+			count++;
+		}
+		if (count > 0 && ring_submit(count, results) == 0)
+			for (size_t i = 0; i < preopen_count; i++)
+				if (results[i] == 0)
+					preopens[i].fd = -EBADF;
+	}
+
+	// Without a ring, or for the ones that failed, fall back to close()
+	for (size_t i = 0; i < preopen_count; i++)
+		if (preopens[i].fd >= 0)
+			close(preopens[i].fd);
+
+	clear_preopens();
+}
+
+/**
+ * Enable the io_uring redirection engine.
+ */
+int uring_enable(const char *value)
+{
+	(void)value;
+
+	enabled = true;
+	if (!ring_get())
+		fprintf(stderr, "set: uring: io_uring unavailable, using open()\n");
+
+	return 0;
+}
+
+/**
+ * Disable the io_uring redirection engine.
+ */
+void uring_disable(void)
+{
+	enabled = false;
+	ring_exit();
+}
@@ -0,0 +1,39 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef _URING_H
+#define _URING_H
+
+#include "../util/parser/parser.h"
+
+/**
+ * Enable the io_uring redirection engine (set -o uring). When io_uring is
+ * not available the shell keeps opening files one by one.
+ * Returns 0 (the option is always accepted).
+ */
+int uring_enable(const char *value);
+
+/**
+ * Disable the io_uring redirection engine (set +o uring).
+ */
+void uring_disable(void);
+
+/**
+ * Open, in a single submission, the redirection files of every stage of
+ * a pipe / parallel group, before its children are spawned.
+ * Returns false if nothing was opened (engine disabled or unavailable).
+ */
+bool uring_open_redirections(command_t *c);
+
+/**
+ * Take the descriptor opened in advance for a redirection word, so that it
+ * is not closed with the group. fd is set to the descriptor or to -errno.
+ * Returns false if the word was not opened in advance.
+ */
+bool uring_take(word_t *w, int *fd);
+
+/**
+ * Close the descriptors of the group that were not taken.
+ */
+void uring_close_redirections(void);
+
+#endif /* _URING_H */
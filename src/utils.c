@@ -1,42 +1,72 @@
 // SPDX-License-Identifier: BSD-3-Clause
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
+#include "stats.h"
 #include "utils.h"
 
+#define VARIABLE_NAME_SIZE 256
+
+/**
+ * Value of the variable a part names, NULL if unset. The name is not NUL
+ * terminated in the parse tree, so it is copied on the stack first.
+ */
+static const char *get_variable(const word_t *s)
+{
+	char buffer[VARIABLE_NAME_SIZE];
+	char *name = buffer;
+	const char *value;
+
+	if (s->length >= sizeof(buffer)) {
+		name = strndup(s->string, s->length);
+		DIE(name == NULL, "Error allocating variable name.");
+	} else {
+		memcpy(name, s->string, s->length);
+		name[s->length] = '\0';
+	}
+
+	value = getenv(name);
+	if (name != buffer)
+		free(name);
+
+	return value;
+}
+
 /**
  * Concatenate parts of the word to obtain the command.
  */
 char *get_word(word_t *s)
 {
 	char *string = NULL;
-	int string_length = 0;
+	size_t string_length = 0;
 
 	const char *substring = NULL;
-	int substring_length = 0;
+	size_t substring_length = 0;
 
 	while (s != NULL) {
 		if (s->expand == true) {
-			substring = getenv(s->string);
+			substring = get_variable(s);
 
 			/* Prevents strlen from failing. */
 			if (substring == NULL)
 				substring = "";
+			substring_length = strlen(substring);
 		} else {
 			substring = s->string;
+			substring_length = s->length;
 		}
 
-		substring_length = strlen(substring);
-
 		string = realloc(string, string_length + substring_length + 1);
 		DIE(string == NULL, "Error allocating word string.");
 
-		string[string_length] = '\0';
-		strcat(string, substring);
-
+		memcpy(string + string_length, substring, substring_length);
 		string_length += substring_length;
+		string[string_length] = '\0';
 
 		s = s->next_part;
 	}
@@ -54,6 +84,7 @@ char **get_argv(simple_command_t *command, int *size)
 	int argc;
 
 	word_t *param;
+	uint64_t start = stats_now();
 
 	argc = 1;
 
@@ -81,6 +112,43 @@ char **get_argv(simple_command_t *command, int *size)
 	}
 
 	*size = argc;
+	stats_record(STATS_EXPAND, start);
 
 	return argv;
 }
+
+/**
+ * Write a whole buffer, retrying after short writes and interruptions.
+ */
+ssize_t write_all(int fd, const void *buf, size_t count)
+{
+	size_t done = 0;
+
+	while (done < count) {
+		ssize_t ret = write(fd, (const char *)buf + done, count - done);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return done > 0 ? (ssize_t)done : -1;
+
+		done += ret;
+	}
+
+	return done;
+}
+
+/**
+ * Move a descriptor above the ones redirections can name.
+ */
+int move_fd_high(int fd)
+{
+	int moved;
+
+	if (fd < 0 || fd >= SHELL_FD_MIN)
+		return fd;
+
+	moved = fcntl(fd, F_DUPFD_CLOEXEC, SHELL_FD_MIN);
+	close(fd);
+	return moved;
+}
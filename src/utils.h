@@ -3,9 +3,14 @@
 #ifndef _UTILS_H
 #define _UTILS_H
 
+#include <sys/types.h>
+
 #include "../util/parser/parser.h"
 
 
+/* The shell's own descriptors stay above those a redirection can name (0-9). */
+#define SHELL_FD_MIN 10
+
 /* Useful macro for handling error codes. */
 #define DIE(assertion, call_description)			\
 	do {							\
@@ -28,4 +33,17 @@ char *get_word(word_t *s);
  */
 char **get_argv(simple_command_t *command, int *size);
 
+/**
+ * Write a whole buffer, retrying after short writes and interruptions.
+ * Returns the number of bytes written, or -1 if nothing could be written.
+ */
+ssize_t write_all(int fd, const void *buf, size_t count);
+
+/**
+ * Move a descriptor the shell keeps for itself to SHELL_FD_MIN or above,
+ * close-on-exec, so that a duplication (3>&1) never replaces it. fd is
+ * closed; returns the new descriptor, or -1 on error (fd may be -1 too).
+ */
+int move_fd_high(int fd);
+
 #endif /* _UTILS_H */
@@ -0,0 +1,486 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#define _GNU_SOURCE
+
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "utils.h"
+#include "zygote.h"
+
+extern char **environ;
+
+/* Descriptors sent with a request: stdin, stdout, stderr and the cwd. */
+#define REQUEST_FDS	4
+
+/* A command to start, followed by size bytes: argv then envp strings. */
+struct request {
+	size_t size;
+	int argc;
+	int envc;
+};
+
+/* A command started (or not, error is set) or finished. */
+struct reply {
+	char kind;
+	pid_t pid;
+	int error;
+	int status;
+	struct rusage usage;
+};
+
+#define REPLY_SPAWNED	'S'
+#define REPLY_EXITED	'X'
+
+/* A command of the spawn server, finished when status is known. */
+struct child {
+	pid_t pid;
+	bool finished;
+	int status;
+	struct rusage usage;
+};
+
+static int zygote_fd = -1;
+static pid_t zygote_pid, owner_pid;
+
+static struct child *children;
+static size_t child_count, child_size;
+
+/**
+ * Send a whole buffer on a socket; a dead peer is an error, not SIGPIPE.
+ */
+static int send_all(int fd, const void *buf, size_t count)
+{
+	const char *data = buf;
+	ssize_t n;
+
+	while (count > 0) {
+		n = send(fd, data, count, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		data += n;
+		count -= n;
+	}
+
+	return 0;
+}
+
+/**
+ * Read a whole buffer; the end of the stream is an error.
+ */
+static int read_all(int fd, void *buf, size_t count)
+{
+	char *data = buf;
+	ssize_t n;
+
+	while (count > 0) {
+		n = read(fd, data, count);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			if (n == 0)
+				errno = EPIPE;
+			return -1;
+		}
+		data += n;
+		count -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * The spawn server
+ */
+
+/**
+ * Exec a command in a child of the spawn server.
+ */
+static void __attribute__((noreturn)) exec_request(char **argv, char **envp,
+												   int *fds)
+{
+	sigset_t empty;
+
+	sigemptyset(&empty);
+	sigprocmask(SIG_SETMASK, &empty, NULL);
+
+	if (fchdir(fds[3]) == -1)
+		perror("chdir");
+	for (int i = 0; i < 3; i++)
+		if (fds[i] != i)
+			dup2(fds[i], i);
+
+	execvpe(argv[0], argv, envp);
+	printf("Execution failed for '%s'\n", argv[0]);
+	fflush(stdout);
+	_exit(127);
+}
+
+/**
+ * Receive a request and start its command.
+ * Returns -1 when the shell is gone.
+ */
+static int serve_request(int sock)
+{
+	char control[CMSG_SPACE(REQUEST_FDS * sizeof(int))];
+	struct request request;
+	struct iovec iov = { &request, sizeof(request) };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = sizeof(control),
+	};
+	struct reply reply = { .kind = REPLY_SPAWNED };
+	struct cmsghdr *cmsg;
+	int fds[REQUEST_FDS], fd_count = 0;
+	char *payload, **strings;
+	ssize_t n;
+
+	do {
+		n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+	} while (n < 0 && errno == EINTR);
+	if (n != sizeof(request))
+		return -1;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET &&
+		cmsg->cmsg_type == SCM_RIGHTS) {
+		fd_count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		memcpy(fds, CMSG_DATA(cmsg), fd_count * sizeof(int));
+	}
+
+	payload = malloc(request.size);
+	strings = malloc((request.argc + request.envc + 2) * sizeof(*strings));
+	DIE(payload == NULL || strings == NULL, "malloc");
+	if (read_all(sock, payload, request.size) == -1)
+		return -1;
+
+	// argv and envp, each terminated by NULL
+	for (int i = 0, k = 0; i < request.argc + request.envc + 2; i++) {
+		if (i == request.argc || i == request.argc + request.envc + 1) {
+			strings[i] = NULL;
+			continue;
+		}
+		strings[i] = payload + k;
+		k += strlen(payload + k) + 1;
+	}
+
+	if (fd_count != REQUEST_FDS) {
+		reply.pid = -1;
+		reply.error = EBADF;
+	} else {
+		reply.pid = fork();
+		reply.error = errno;
+		if (reply.pid == 0)
+			exec_request(strings, strings + request.argc + 1, fds);
+	}
+
+	for (int i = 0; i < fd_count; i++)
+		close(fds[i]);
+	free(strings);
+	free(payload);
+
+	return send_all(sock, &reply, sizeof(reply));
+}
+
+/**
+ * Report every command that finished.
+ */
+static int reap_children(int sock)
+{
+	struct reply reply = { .kind = REPLY_EXITED };
+
+	while ((reply.pid = wait4(-1, &reply.status, WNOHANG, &reply.usage)) > 0)
+		if (send_all(sock, &reply, sizeof(reply)) == -1)
+			return -1;
+
+	return 0;
+}
+
+/**
+ * Serve the shell until it goes away.
+ */
+static void __attribute__((noreturn)) serve(int sock)
+{
+	struct signalfd_siginfo info;
+	struct pollfd pfds[2];
+	sigset_t mask;
+	int sfd, null;
+
+	// Keep no pipe of the shell open, a reader would never see its end
+	null = open("/dev/null", O_RDWR);
+	for (int i = 0; i < 3 && null != -1; i++)
+		dup2(null, i);
+	if (null > STDERR_FILENO)
+		close(null);
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	sfd = signalfd(-1, &mask, SFD_CLOEXEC);
+	DIE(sfd == -1, "signalfd");
+
+	pfds[0] = (struct pollfd) { .fd = sock, .events = POLLIN };
+	pfds[1] = (struct pollfd) { .fd = sfd, .events = POLLIN };
+
+	for (;;) {
+		if (poll(pfds, 2, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			_exit(EXIT_FAILURE);
+		}
+
+		if (pfds[1].revents & POLLIN) {
+			if (read(sfd, &info, sizeof(info)) < 0 && errno != EAGAIN)
+				_exit(EXIT_FAILURE);
+			if (reap_children(sock) == -1)
+				_exit(EXIT_SUCCESS);
+		}
+
+		if (pfds[0].revents & (POLLIN | POLLHUP | POLLERR))
+			if (serve_request(sock) == -1)
+				_exit(EXIT_SUCCESS);
+	}
+}
+
+/*
+ * The shell
+ */
+
+/**
+ * Start the spawn server.
+ */
+int zygote_start(void)
+{
+	int sv[2];
+
+	zygote_stop();
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1) {
+		perror("socketpair");
+		return -1;
+	}
+
+	zygote_pid = fork();
+	if (zygote_pid == -1) {
+		perror("fork");
+		close(sv[0]);
+		close(sv[1]);
+		return -1;
+	}
+
+	if (zygote_pid == 0) {
+		close(sv[0]);
+		serve(sv[1]);
+	}
+
+	close(sv[1]);
+	zygote_fd = move_fd_high(sv[0]);
+	if (zygote_fd == -1) {
+		// With its socket closed, the server ends
+		perror("fcntl");
+		waitpid(zygote_pid, NULL, 0);
+		return -1;
+	}
+	owner_pid = getpid();
+
+	return 0;
+}
+
+/**
+ * Stop the spawn server.
+ */
+void zygote_stop(void)
+{
+	int status;
+
+	if (zygote_fd == -1)
+		return;
+
+	// Closing the socket ends the server
+	close(zygote_fd);
+	zygote_fd = -1;
+	if (owner_pid == getpid())
+		waitpid(zygote_pid, &status, 0);
+
+	free(children);
+	children = NULL;
+	child_count = child_size = 0;
+}
+
+/**
+ * Check if external commands can be started by the spawn server.
+ */
+bool zygote_enabled(void)
+{
+	return zygote_fd != -1 && owner_pid == getpid();
+}
+
+/**
+ * Find a command of the spawn server.
+ */
+static struct child *find_child(pid_t pid)
+{
+	for (size_t i = 0; i < child_count; i++)
+		if (children[i].pid == pid)
+			return &children[i];
+
+	return NULL;
+}
+
+/**
+ * Read a reply of the spawn server, remembering the commands that finished.
+ * Returns the reply to a request, or sets kind to 0 on error.
+ */
+static void read_reply(struct reply *reply)
+{
+	struct child *c;
+
+	if (read_all(zygote_fd, reply, sizeof(*reply)) == -1) {
+		reply->kind = 0;
+		return;
+	}
+
+	if (reply->kind != REPLY_EXITED)
+		return;
+
+	c = find_child(reply->pid);
+	if (c != NULL) {
+		c->finished = true;
+		c->status = reply->status;
+		c->usage = reply->usage;
+	}
+}
+
+/**
+ * The server is gone: forget it, its commands can no longer be waited for.
+ */
+static void lost_server(void)
+{
+	fprintf(stderr, "zygote: spawn server lost, forking again\n");
+	zygote_stop();
+}
+
+/**
+ * Start argv through the spawn server.
+ */
+pid_t zygote_spawn(char **argv, const int fds[3])
+{
+	char control[CMSG_SPACE(REQUEST_FDS * sizeof(int))] = { 0 };
+	struct request request = { 0 };
+	struct iovec iov = { &request, sizeof(request) };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = sizeof(control),
+	};
+	int sent[REQUEST_FDS] = { fds[0], fds[1], fds[2], -1 };
+	struct cmsghdr *cmsg;
+	struct reply reply;
+	char *payload, *p;
+	int ret;
+
+	for (; argv[request.argc] != NULL; request.argc++)
+		request.size += strlen(argv[request.argc]) + 1;
+	for (; environ[request.envc] != NULL; request.envc++)
+		request.size += strlen(environ[request.envc]) + 1;
+
+	payload = p = malloc(request.size);
+	DIE(payload == NULL, "malloc");
+	for (int i = 0; i < request.argc; i++)
+		p = stpcpy(p, argv[i]) + 1;
+	for (int i = 0; i < request.envc; i++)
+		p = stpcpy(p, environ[i]) + 1;
+
+	// The working directory goes as a descriptor, the server enters it
+	sent[3] = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (sent[3] == -1) {
+		free(payload);
+		return -1;
+	}
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(sent));
+	memcpy(CMSG_DATA(cmsg), sent, sizeof(sent));
+
+	do {
+		ret = sendmsg(zygote_fd, &msg, MSG_NOSIGNAL);
+	} while (ret < 0 && errno == EINTR);
+	if (ret == sizeof(request))
+		ret = send_all(zygote_fd, payload, request.size);
+	else
+		ret = -1;
+	close(sent[3]);
+	free(payload);
+
+	if (ret == -1) {
+		lost_server();
+		return -1;
+	}
+
+	// Commands that finished meanwhile may be reported first
+	do {
+		read_reply(&reply);
+	} while (reply.kind == REPLY_EXITED);
+	if (reply.kind != REPLY_SPAWNED) {
+		lost_server();
+		return -1;
+	}
+	if (reply.pid == -1) {
+		errno = reply.error;
+		return -1;
+	}
+
+	if (child_count == child_size) {
+		child_size = child_size ? 2 * child_size : 8;
+		children = realloc(children, child_size * sizeof(*children));
+		DIE(children == NULL, "realloc");
+	}
+	children[child_count++] = (struct child) { .pid = reply.pid };
+
+	return reply.pid;
+}
+
+/**
+ * Wait for a command started by the spawn server.
+ */
+pid_t zygote_wait(pid_t pid, int *status, struct rusage *usage)
+{
+	struct child *c;
+	struct reply reply;
+
+	if (!zygote_enabled() || (c = find_child(pid)) == NULL)
+		return 0;
+
+	while (!c->finished) {
+		read_reply(&reply);
+		if (reply.kind != REPLY_EXITED) {
+			lost_server();
+			errno = ECHILD;
+			return -1;
+		}
+	}
+
+	*status = c->status;
+	*usage = c->usage;
+	*c = children[--child_count];
+
+	return pid;
+}
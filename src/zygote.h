@@ -0,0 +1,43 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef _ZYGOTE_H
+#define _ZYGOTE_H
+
+#include <sys/resource.h>
+#include <sys/types.h>
+
+#include "../util/parser/parser.h"
+
+/**
+ * Start the spawn server: a child forked while the shell is still small,
+ * which forks and execs external commands on its behalf, so that their
+ * cost does not grow with the memory of the shell (MINISHELL_ZYGOTE=1).
+ * Returns 0 on success and -1 on error.
+ */
+int zygote_start(void);
+
+/**
+ * Stop the spawn server; the commands it started keep running.
+ */
+void zygote_stop(void);
+
+/**
+ * Check if external commands can be started by the spawn server, which
+ * only serves the process that started it.
+ */
+bool zygote_enabled(void);
+
+/**
+ * Start argv (searched in PATH) with the environment of the shell, its
+ * working directory and fds as stdin, stdout and stderr.
+ * Returns the pid of the command, or -1 on error (errno is set).
+ */
+pid_t zygote_spawn(char **argv, const int fds[3]);
+
+/**
+ * Wait for a command started by the spawn server, like wait4().
+ * Returns pid, 0 if pid was not started by the spawn server or -1 on error.
+ */
+pid_t zygote_wait(pid_t pid, int *status, struct rusage *usage);
+
+#endif /* _ZYGOTE_H */
@@ -223,6 +223,14 @@ test_fun_array=(
 	test_common_alt "Testing sleep command" 7
 	test_common_alt "Testing fscanf function" 7
 	test_exec_failed "Testing unknown command" 4
+	test_common "Testing time keyword" 1
+	test_exec_failed "Testing command string and script file" 1
+	test_exec_failed "Testing memo prefix" 1
+	test_common "Testing command groups" 2
+	test_common "Testing descriptor duplication" 2
+	test_exec_failed "Testing multiple redirections" 1
+	test_exec_failed "Testing fan-out operator" 1
+	test_exec_failed "Testing execution trace" 1
 )
 
 # ----------------- Run test ------------------------------------------------- #
@@ -2,7 +2,7 @@
 # SPDX-License-Identifier: BSD-3-Clause
 
 first_test=0
-last_test=18
+last_test=26
 script=./_test/run_test.sh
 
 exec_name="mini-shell"
@@ -27,7 +27,9 @@ static void displayWord(word_t * w)
 	while (crt != NULL) {
 		if (crt->expand)
 			std::cout << "expand(";
-		std::cout << "'" << crt->string << "'";
+		std::cout << "'";
+		std::cout.write(crt->string, crt->length);
+		std::cout << "'";
 		if (crt->expand)
 			std::cout << ")";
 
@@ -62,10 +64,13 @@ static void displaySimple(simple_command_t * s, int level, command_t * father)
 
 	std::cout << std::setw(2 * indent * level) << "" << "simple_command_t (" << std::endl;
 
-	std::cout << std::setw(2 * indent * level + indent) << "" << "verb (" << std::endl;
-	displayList(s->verb, level + 1);
-	assert(s->verb->next_word == NULL);
-	std::cout << std::setw(2 * indent * level + indent) << "" << ")" << std::endl;
+	/* the redirections of a group have no verb */
+	if (s->verb != NULL) {
+		std::cout << std::setw(2 * indent * level + indent) << "" << "verb (" << std::endl;
+		displayList(s->verb, level + 1);
+		assert(s->verb->next_word == NULL);
+		std::cout << std::setw(2 * indent * level + indent) << "" << ")" << std::endl;
+	}
 
 	if (s->params != NULL) {
 		std::cout << std::setw(2 * indent * level + indent) << "" << "params (" << std::endl;
@@ -95,6 +100,19 @@ static void displaySimple(simple_command_t * s, int level, command_t * father)
 		std::cout << std::setw(2 * indent * level + indent) << "" << ")" << std::endl;
 	}
 
+	if (s->dup != NULL) {
+		std::cout << std::setw(2 * indent * level + indent) << "" << "dup (" << std::endl;
+		for (dup_t * d = s->dup; d != NULL; d = d->next) {
+			std::cout << std::setw(2 * indent * (level+1)) << "" << d->fd << " <- ";
+			if (d->source == -1)
+				std::cout << "CLOSE";
+			else
+				std::cout << d->source;
+			std::cout << (d->before_files ? " BEFORE FILES" : "") << std::endl;
+		}
+		std::cout << std::setw(2 * indent * level + indent) << "" << ")" << std::endl;
+	}
+
 	std::cout << std::setw(2 * indent * level) << "" << ")" << std::endl;
 }
 
@@ -111,6 +129,16 @@ static void displayCommand(command_t * c, int level, command_t * father)
 		std::cout << std::setw(2 * indent * level + indent) << "" << "scmd (" << std::endl;
 		displaySimple(c->scmd, level + 1, c);
 		std::cout << std::setw(2 * indent * level + indent) << "" << ")" << std::endl;
+	} else if (c->op == OP_BRACE_GROUP || c->op == OP_SUBSHELL) {
+		assert(c->cmd2 == NULL);
+		std::cout << std::setw(2 * indent * level + indent) << "" << "op == "
+			<< (c->op == OP_BRACE_GROUP ? "OP_BRACE_GROUP" : "OP_SUBSHELL") << std::endl;
+		std::cout << std::setw(2 * indent * level + indent) << "" << "cmd1 (" << std::endl;
+		displayCommand(c->cmd1, level + 1, c);
+		std::cout << std::setw(2 * indent * level + indent) << "" << ")" << std::endl;
+		std::cout << std::setw(2 * indent * level + indent) << "" << "scmd (" << std::endl;
+		displaySimple(c->scmd, level + 1, c);
+		std::cout << std::setw(2 * indent * level + indent) << "" << ")" << std::endl;
 	} else {
 		assert(c->scmd == NULL);
 		std::cout << std::setw(2 * indent * level + indent) << "" << "op == ";
@@ -131,6 +159,9 @@ static void displayCommand(command_t * c, int level, command_t * father)
 		case OP_PIPE:
 			std::cout << "OP_PIPE";
 			break;
+		case OP_FANOUT:
+			std::cout << "OP_FANOUT";
+			break;
 		default:
 			assert(false);
 		}
@@ -0,0 +1,460 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+ * Fuzz target for parse_line() (see README, "Fuzzing")
+
+ * For every input it checks the properties of the tree documented in
+ * parser.h, that free_parse_memory() releases everything parse_line()
+ * allocated, that the hand-written parser (rdparser.c, through its
+ * reentrant interface) builds the same tree or fails at the same column
+ * as the parser the target is linked with, and that the tree is the same
+ * after a trip through a compact tree (ctree.h).
+
+ * Any mismatch prints the input and aborts, which is what libFuzzer and
+ * AFL report as a crash.
+
+ * Built with -DFUZZ_LIBFUZZER the file only provides
+ * LLVMFuzzerTestOneInput(); otherwise main() runs every file given on the
+ * command line, or stdin (as AFL expects), as a single input.
+ */
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+#include "./parser.h"
+#include "./ctree.h"
+#include "./rdparser.h"
+
+#ifdef UNICODE
+#  error "Unicode not supported in this source file!"
+#endif
+
+static int errorColumn;
+static std::string currentInput;
+
+
+void parse_error(const char * str, const int where)
+{
+	(void)str;
+	errorColumn = where;
+}
+
+
+static void fail(const char * what)
+{
+	std::cerr << "FuzzParser: " << what << std::endl;
+	std::cerr << "input: \"";
+	for (size_t i = 0; i < currentInput.length(); i++) {
+		unsigned char c = (unsigned char)currentInput[i];
+
+		if (c == '"' || c == '\\')
+			std::cerr << '\\' << c;
+		else if (c >= ' ' && c < 0x7f)
+			std::cerr << c;
+		else {
+			char hex[8];
+
+			snprintf(hex, sizeof(hex), "\\x%02x", c);
+			std::cerr << hex;
+		}
+	}
+	std::cerr << "\"" << std::endl;
+	abort();
+}
+
+#define CHECK(condition) \
+	do { \
+		if (!(condition)) \
+			fail("check failed: " #condition); \
+	} while (0)
+
+
+/*
+ * Invariants of parser.h
+ */
+
+/*
+ * Operators deeper in the tree bind at least as strongly (OP_NONE and the
+ * groups the most), up to the nearest group
+ */
+static int priority(operator_t op)
+{
+	switch (op) {
+	case OP_SEQUENTIAL:
+		return 1;
+	case OP_PARALLEL:
+		return 2;
+	case OP_CONDITIONAL_ZERO:
+	case OP_CONDITIONAL_NZERO:
+		return 3;
+	case OP_FANOUT:
+		return 4;
+	case OP_PIPE:
+		return 5;
+	case OP_NONE:
+	case OP_BRACE_GROUP:
+	case OP_SUBSHELL:
+		return 6;
+	default:
+		fail("unknown operator");
+		return 0;
+	}
+}
+
+
+static bool isNameChar(char c, bool first)
+{
+	return c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+		(!first && c >= '0' && c <= '9');
+}
+
+
+/*
+ * Every list element and every part comes from at least one character of
+ * the input, so walks longer than that mean a cycle.
+ */
+
+static void checkWord(word_t * w, bool quoted)
+{
+	size_t parts = 0;
+
+	for (word_t * crt = w; crt != NULL; crt = crt->next_part) {
+		CHECK(++parts <= currentInput.length());
+		CHECK(crt->string != NULL);
+		CHECK(crt->length <= currentInput.length());
+		if (crt != w)
+			CHECK(crt->next_word == NULL);
+
+		if (crt->expand) {
+			CHECK(crt->length > 0 && isNameChar(crt->string[0], true));
+			for (size_t i = 1; i < crt->length; i++)
+				CHECK(isNameChar(crt->string[i], false));
+		} else if (!quoted && memchr(crt->string, '=', crt->length) != NULL) {
+			/* '=' is a part of its own, except in quotes */
+			CHECK(crt->length == 1);
+		}
+	}
+}
+
+
+static void checkList(word_t * w, bool quoted)
+{
+	size_t words = 0;
+
+	for (word_t * crt = w; crt != NULL; crt = crt->next_word) {
+		CHECK(++words <= currentInput.length());
+		checkWord(crt, quoted);
+	}
+}
+
+
+static void checkDups(dup_t * d)
+{
+	size_t dups = 0;
+
+	for (; d != NULL; d = d->next) {
+		CHECK(++dups <= currentInput.length());
+		CHECK(d->fd >= 0 && d->fd <= 9);
+		CHECK(d->source >= -1 && d->source <= 9);
+	}
+}
+
+
+static void checkCommand(command_t * c, command_t * father, size_t * nodes)
+{
+	bool quoted = currentInput.find_first_of("'\"") != std::string::npos;
+
+	CHECK(c != NULL);
+	CHECK(++*nodes <= currentInput.length());
+	CHECK(c->up == father);
+	CHECK(c->aux == NULL);
+	if (father != NULL && father->op != OP_BRACE_GROUP && father->op != OP_SUBSHELL)
+		CHECK(priority(c->op) >= priority(father->op));
+
+	if (c->op == OP_NONE) {
+		simple_command_t * s = c->scmd;
+
+		CHECK(s != NULL);
+		CHECK(c->cmd1 == NULL && c->cmd2 == NULL);
+		CHECK(s->up == c);
+		CHECK(s->aux == NULL);
+		CHECK(s->verb != NULL);
+		CHECK(s->verb->next_word == NULL);
+		CHECK((s->io_flags & ~(IO_OUT_APPEND | IO_ERR_APPEND)) == 0);
+		checkList(s->verb, quoted);
+		checkList(s->params, quoted);
+		checkList(s->in, quoted);
+		checkList(s->out, quoted);
+		checkList(s->err, quoted);
+		checkDups(s->dup);
+	} else if (c->op == OP_BRACE_GROUP || c->op == OP_SUBSHELL) {
+		simple_command_t * s = c->scmd;
+
+		CHECK(s != NULL);
+		CHECK(c->cmd2 == NULL);
+		CHECK(s->up == c);
+		CHECK(s->aux == NULL);
+		CHECK(s->verb == NULL && s->params == NULL);
+		CHECK((s->io_flags & ~(IO_OUT_APPEND | IO_ERR_APPEND)) == 0);
+		checkList(s->in, quoted);
+		checkList(s->out, quoted);
+		checkList(s->err, quoted);
+		checkDups(s->dup);
+		checkCommand(c->cmd1, c, nodes);
+	} else {
+		CHECK(c->scmd == NULL);
+		checkCommand(c->cmd1, c, nodes);
+		checkCommand(c->cmd2, c, nodes);
+	}
+}
+
+
+/*
+ * Differential comparison
+ */
+
+static bool sameWord(word_t * a, word_t * b)
+{
+	for (; a != NULL && b != NULL; a = a->next_part, b = b->next_part)
+		if (a->expand != b->expand || a->length != b->length ||
+			memcmp(a->string, b->string, a->length) != 0)
+			return false;
+
+	return a == NULL && b == NULL;
+}
+
+
+static bool sameList(word_t * a, word_t * b)
+{
+	for (; a != NULL && b != NULL; a = a->next_word, b = b->next_word)
+		if (!sameWord(a, b))
+			return false;
+
+	return a == NULL && b == NULL;
+}
+
+
+static bool sameDups(dup_t * a, dup_t * b)
+{
+	for (; a != NULL && b != NULL; a = a->next, b = b->next)
+		if (a->fd != b->fd || a->source != b->source ||
+			a->before_files != b->before_files)
+			return false;
+
+	return a == NULL && b == NULL;
+}
+
+
+static bool sameCommand(command_t * a, command_t * b)
+{
+	if (a == NULL || b == NULL)
+		return a == b;
+	if (a->op != b->op)
+		return false;
+
+	if (a->op != OP_NONE && a->scmd == NULL)
+		return sameCommand(a->cmd1, b->cmd1) && sameCommand(a->cmd2, b->cmd2);
+	if (a->op != OP_NONE && !sameCommand(a->cmd1, b->cmd1))
+		return false;
+
+	return sameList(a->scmd->verb, b->scmd->verb) &&
+		sameList(a->scmd->params, b->scmd->params) &&
+		sameList(a->scmd->in, b->scmd->in) &&
+		sameList(a->scmd->out, b->scmd->out) &&
+		sameList(a->scmd->err, b->scmd->err) &&
+		sameDups(a->scmd->dup, b->scmd->dup) &&
+		a->scmd->io_flags == b->scmd->io_flags;
+}
+
+
+/*
+ * Blocks allocated and not freed yet, to tell whether free_parse_memory()
+ * released everything (libFuzzer and the address sanitizer find leaks on
+ * their own, the count is only kept in the standalone driver)
+ */
+
+#if !defined(FUZZ_LIBFUZZER) && !defined(__SANITIZE_ADDRESS__) && defined(__GLIBC__)
+
+static long liveBlocks;
+
+extern "C" {
+
+void * __libc_malloc(size_t size);
+void * __libc_calloc(size_t count, size_t size);
+void * __libc_realloc(void * ptr, size_t size);
+void __libc_free(void * ptr);
+
+
+void * malloc(size_t size) throw()
+{
+	void * ptr = __libc_malloc(size);
+
+	if (ptr != NULL)
+		liveBlocks++;
+	return ptr;
+}
+
+
+void * calloc(size_t count, size_t size) throw()
+{
+	void * ptr = __libc_calloc(count, size);
+
+	if (ptr != NULL)
+		liveBlocks++;
+	return ptr;
+}
+
+
+void * realloc(void * ptr, size_t size) throw()
+{
+	void * newPtr = __libc_realloc(ptr, size);
+
+	if (ptr == NULL && newPtr != NULL)
+		liveBlocks++;
+	else if (ptr != NULL && size == 0 && newPtr == NULL)
+		liveBlocks--;
+	return newPtr;
+}
+
+
+void free(void * ptr) throw()
+{
+	if (ptr != NULL)
+		liveBlocks--;
+	__libc_free(ptr);
+}
+
+}
+
+#else
+
+static long liveBlocks;
+
+#endif
+
+
+/* The tree, through a compact tree (ctree.h) and back */
+static command_t * roundTrip(command_t * root)
+{
+	static ct_tree_t tree;
+	static void * nodes = NULL;
+	size_t nodeCount = 0;
+	command_t * copy;
+
+	ct_from_command(&tree, root);
+	free(nodes);
+	nodes = malloc(ct_command_size(&tree) + 1);	/* not 0 for an empty line */
+	CHECK(nodes != NULL);
+	copy = ct_to_command(&tree, nodes);
+	if (copy != NULL)
+		checkCommand(copy, NULL, &nodeCount);
+
+	return copy;
+}
+
+
+static bool parseOnce(command_t ** root)
+{
+	*root = NULL;
+	errorColumn = -1;
+
+	return parse_line(currentInput.c_str(), root);
+}
+
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t * data, size_t size)
+{
+	static rd_context_t * rd = NULL;
+	command_t * root;
+	command_t * rdRoot = NULL;
+	size_t nodes = 0;
+	long used, rdUsed;
+	bool parsed;
+	int where = -1;
+
+	if (rd == NULL) {
+		rd = rd_create();
+		CHECK(rd != NULL);
+	}
+
+	/* parse_line() takes a C string, the input ends at the first NUL */
+	currentInput.assign((const char *)data, strnlen((const char *)data, size));
+
+	/*
+	 * The same line parsed again must leave as much memory in use as the
+	 * first time (the first one may keep buffers from the previous input)
+	 */
+	parseOnce(&root);
+	free_parse_memory();
+	used = liveBlocks;
+
+	parsed = parseOnce(&root);
+	if (parsed) {
+		if (root != NULL)
+			checkCommand(root, NULL, &nodes);
+	} else {
+		CHECK(root == NULL);
+		CHECK(errorColumn >= 0 && (size_t)errorColumn <= currentInput.length());
+	}
+
+	/* the arena of rd may grow meanwhile, that is not counted */
+	rdUsed = liveBlocks;
+	if (rd_parse(rd, currentInput.c_str(), currentInput.length(), &rdRoot, &where) != parsed)
+		fail(parsed ? "only the hand-written parser rejects the line" :
+			"only the hand-written parser accepts the line");
+	if (parsed && !sameCommand(root, rdRoot))
+		fail("the parsers build different trees");
+	if (parsed && !sameCommand(root, roundTrip(root)))
+		fail("the compact tree of the parse_line() tree is different");
+	if (!parsed && where != errorColumn)
+		fail("the parsers report the error at different columns");
+	rd_reset(rd);
+	used += liveBlocks - rdUsed;
+
+	free_parse_memory();
+	if (liveBlocks != used)
+		fail("free_parse_memory() does not release the tree");
+
+	return 0;
+}
+
+
+#ifndef FUZZ_LIBFUZZER
+
+static void runInput(std::istream & in)
+{
+	std::stringstream buffer;
+	std::string data;
+
+	buffer << in.rdbuf();
+	data = buffer.str();
+	LLVMFuzzerTestOneInput((const uint8_t *)data.data(), data.length());
+}
+
+
+int main(int argc, char * argv[])
+{
+	if (argc < 2) {
+		runInput(std::cin);
+		return EXIT_SUCCESS;
+	}
+
+	for (int i = 1; i < argc; i++) {
+		std::ifstream in(argv[i], std::ios::binary);
+
+		if (!in) {
+			std::cerr << "Cannot open " << argv[i] << std::endl;
+			return EXIT_FAILURE;
+		}
+		runInput(in);
+	}
+
+	return EXIT_SUCCESS;
+}
+
+#endif
@@ -0,0 +1,432 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+ * Compact parse tree (see ctree.h)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "parser.h"
+#include "ctree.h"
+
+
+#define FIRST_CAPACITY	64
+
+#define NODE(base, i)	((i) == CT_NIL ? NULL : (base) + (i))
+
+
+static void * grow(void * array, size_t size)
+{
+	void * ptr = realloc(array, size);
+
+	if (ptr == NULL) {
+		fprintf(stderr, "malloc() failed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	return ptr;
+}
+
+
+static size_t next_capacity(size_t capacity)
+{
+	return capacity == 0 ? FIRST_CAPACITY : 2 * capacity;
+}
+
+
+static void reserve_parts(ct_tree_t * tree)
+{
+	size_t n;
+
+	if (tree->part_count < tree->part_capacity)
+		return;
+
+	n = tree->part_capacity = next_capacity(tree->part_capacity);
+	tree->part_offset = (uint32_t *)grow(tree->part_offset, n * sizeof(uint32_t));
+	tree->part_length = (uint32_t *)grow(tree->part_length, n * sizeof(uint32_t));
+	tree->part_expand = (uint8_t *)grow(tree->part_expand, n * sizeof(uint8_t));
+	tree->next_part = (ct_index_t *)grow(tree->next_part, n * sizeof(ct_index_t));
+	tree->next_word = (ct_index_t *)grow(tree->next_word, n * sizeof(ct_index_t));
+}
+
+
+static void reserve_dups(ct_tree_t * tree)
+{
+	size_t n;
+
+	if (tree->dup_count < tree->dup_capacity)
+		return;
+
+	n = tree->dup_capacity = next_capacity(tree->dup_capacity);
+	tree->dup_fd = (int8_t *)grow(tree->dup_fd, n * sizeof(int8_t));
+	tree->dup_source = (int8_t *)grow(tree->dup_source, n * sizeof(int8_t));
+	tree->dup_before_files = (uint8_t *)grow(tree->dup_before_files,
+		n * sizeof(uint8_t));
+	tree->next_dup = (ct_index_t *)grow(tree->next_dup, n * sizeof(ct_index_t));
+}
+
+
+static void reserve_simple(ct_tree_t * tree)
+{
+	size_t n;
+
+	if (tree->simple_count < tree->simple_capacity)
+		return;
+
+	n = tree->simple_capacity = next_capacity(tree->simple_capacity);
+	tree->verb = (ct_index_t *)grow(tree->verb, n * sizeof(ct_index_t));
+	tree->params = (ct_index_t *)grow(tree->params, n * sizeof(ct_index_t));
+	tree->in = (ct_index_t *)grow(tree->in, n * sizeof(ct_index_t));
+	tree->out = (ct_index_t *)grow(tree->out, n * sizeof(ct_index_t));
+	tree->err = (ct_index_t *)grow(tree->err, n * sizeof(ct_index_t));
+	tree->dup = (ct_index_t *)grow(tree->dup, n * sizeof(ct_index_t));
+	tree->io_flags = (uint8_t *)grow(tree->io_flags, n * sizeof(uint8_t));
+	tree->scmd_up = (ct_index_t *)grow(tree->scmd_up, n * sizeof(ct_index_t));
+}
+
+
+static void reserve_command(ct_tree_t * tree)
+{
+	size_t n;
+
+	if (tree->command_count < tree->command_capacity)
+		return;
+
+	n = tree->command_capacity = next_capacity(tree->command_capacity);
+	tree->op = (uint8_t *)grow(tree->op, n * sizeof(uint8_t));
+	tree->cmd1 = (ct_index_t *)grow(tree->cmd1, n * sizeof(ct_index_t));
+	tree->cmd2 = (ct_index_t *)grow(tree->cmd2, n * sizeof(ct_index_t));
+	tree->scmd = (ct_index_t *)grow(tree->scmd, n * sizeof(ct_index_t));
+	tree->up = (ct_index_t *)grow(tree->up, n * sizeof(ct_index_t));
+}
+
+
+void ct_init(ct_tree_t * tree)
+{
+	memset(tree, 0, sizeof(*tree));
+	tree->root = CT_NIL;
+}
+
+
+void ct_clear(ct_tree_t * tree)
+{
+	tree->part_count = 0;
+	tree->dup_count = 0;
+	tree->simple_count = 0;
+	tree->command_count = 0;
+	tree->pool_size = 0;
+	tree->root = CT_NIL;
+}
+
+
+void ct_free(ct_tree_t * tree)
+{
+	free(tree->part_offset);
+	free(tree->part_length);
+	free(tree->part_expand);
+	free(tree->next_part);
+	free(tree->next_word);
+	free(tree->dup_fd);
+	free(tree->dup_source);
+	free(tree->dup_before_files);
+	free(tree->next_dup);
+	free(tree->verb);
+	free(tree->params);
+	free(tree->in);
+	free(tree->out);
+	free(tree->err);
+	free(tree->dup);
+	free(tree->io_flags);
+	free(tree->scmd_up);
+	free(tree->op);
+	free(tree->cmd1);
+	free(tree->cmd2);
+	free(tree->scmd);
+	free(tree->up);
+	free(tree->pool);
+	ct_init(tree);
+}
+
+
+ct_index_t ct_add_part(ct_tree_t * tree, const char * str, size_t len, bool expand)
+{
+	ct_index_t i = (ct_index_t)tree->part_count;
+
+	reserve_parts(tree);
+	if (tree->pool_size + len + 1 > tree->pool_capacity) {
+		size_t capacity = next_capacity(tree->pool_capacity);
+
+		while (capacity < tree->pool_size + len + 1)
+			capacity *= 2;
+		tree->pool = (char *)grow(tree->pool, capacity);
+		tree->pool_capacity = capacity;
+	}
+
+	memcpy(tree->pool + tree->pool_size, str, len);
+	tree->pool[tree->pool_size + len] = '\0';
+
+	tree->part_offset[i] = (uint32_t)tree->pool_size;
+	tree->part_length[i] = (uint32_t)len;
+	tree->part_expand[i] = expand ? 1 : 0;
+	tree->next_part[i] = CT_NIL;
+	tree->next_word[i] = CT_NIL;
+	tree->pool_size += len + 1;
+	tree->part_count++;
+
+	return i;
+}
+
+
+ct_index_t ct_append_word(ct_tree_t * tree, ct_index_t lst, ct_index_t w)
+{
+	ct_index_t crt = lst;
+
+	if (crt == CT_NIL)
+		return w;
+
+	while (tree->next_word[crt] != CT_NIL)
+		crt = tree->next_word[crt];
+
+	/* a word of "&>" can already be at the end of the list (see parser.y) */
+	if (crt != w)
+		tree->next_word[crt] = w;
+
+	return lst;
+}
+
+
+ct_index_t ct_append_dup(ct_tree_t * tree, ct_index_t lst, int fd, int source,
+	bool before_files)
+{
+	ct_index_t i = (ct_index_t)tree->dup_count, crt = lst;
+
+	reserve_dups(tree);
+	tree->dup_fd[i] = (int8_t)fd;
+	tree->dup_source[i] = (int8_t)source;
+	tree->dup_before_files[i] = (uint8_t)before_files;
+	tree->next_dup[i] = CT_NIL;
+	tree->dup_count++;
+
+	if (crt == CT_NIL)
+		return i;
+
+	while (tree->next_dup[crt] != CT_NIL)
+		crt = tree->next_dup[crt];
+	tree->next_dup[crt] = i;
+
+	return lst;
+}
+
+
+ct_index_t ct_add_simple(ct_tree_t * tree, ct_index_t verb, ct_index_t params)
+{
+	ct_index_t i = (ct_index_t)tree->simple_count;
+
+	reserve_simple(tree);
+	tree->verb[i] = verb;
+	tree->params[i] = params;
+	tree->in[i] = CT_NIL;
+	tree->out[i] = CT_NIL;
+	tree->err[i] = CT_NIL;
+	tree->dup[i] = CT_NIL;
+	tree->io_flags[i] = IO_REGULAR;
+	tree->scmd_up[i] = CT_NIL;
+	tree->simple_count++;
+
+	return i;
+}
+
+
+ct_index_t ct_add_command(ct_tree_t * tree, operator_t op, ct_index_t cmd1,
+	ct_index_t cmd2, ct_index_t scmd)
+{
+	ct_index_t i = (ct_index_t)tree->command_count;
+
+	reserve_command(tree);
+	tree->op[i] = (uint8_t)op;
+	tree->cmd1[i] = cmd1;
+	tree->cmd2[i] = cmd2;
+	tree->scmd[i] = scmd;
+	tree->up[i] = CT_NIL;
+	tree->command_count++;
+
+	if (cmd1 != CT_NIL)
+		tree->up[cmd1] = i;
+	if (cmd2 != CT_NIL)
+		tree->up[cmd2] = i;
+	if (scmd != CT_NIL)
+		tree->scmd_up[scmd] = i;
+
+	return i;
+}
+
+
+/*
+ * Conversion from parser.h structures
+ */
+
+static ct_index_t from_word(ct_tree_t * tree, const word_t * w)
+{
+	ct_index_t first = CT_NIL, last = CT_NIL;
+
+	for (; w != NULL; w = w->next_part) {
+		ct_index_t i = ct_add_part(tree, w->string, w->length, w->expand);
+
+		if (last == CT_NIL)
+			first = i;
+		else
+			tree->next_part[last] = i;
+		last = i;
+	}
+
+	return first;
+}
+
+
+/*
+ * Index of w if it is an element of the list lst, already converted to
+ * the list that starts with lst_index (words shared by the out and err
+ * lists are converted once)
+ */
+static ct_index_t find_shared(const ct_tree_t * tree, const word_t * w,
+	const word_t * lst, ct_index_t lst_index)
+{
+	for (; lst != NULL; lst = lst->next_word, lst_index = tree->next_word[lst_index])
+		if (lst == w)
+			return lst_index;
+
+	return CT_NIL;
+}
+
+
+static ct_index_t from_list(ct_tree_t * tree, const word_t * w,
+	const word_t * shared, ct_index_t shared_index)
+{
+	ct_index_t first = CT_NIL, last = CT_NIL;
+
+	for (; w != NULL; w = w->next_word) {
+		ct_index_t i = find_shared(tree, w, shared, shared_index);
+		bool done = i != CT_NIL;
+
+		if (!done)
+			i = from_word(tree, w);
+		if (last == CT_NIL)
+			first = i;
+		else
+			tree->next_word[last] = i;
+		last = i;
+
+		/* the rest of the list is shared as well */
+		if (done)
+			break;
+	}
+
+	return first;
+}
+
+
+static ct_index_t from_simple(ct_tree_t * tree, const simple_command_t * scmd)
+{
+	ct_index_t s = ct_add_simple(tree, from_list(tree, scmd->verb, NULL, CT_NIL),
+		from_list(tree, scmd->params, NULL, CT_NIL));
+	const dup_t * d;
+
+	tree->in[s] = from_list(tree, scmd->in, NULL, CT_NIL);
+	tree->out[s] = from_list(tree, scmd->out, NULL, CT_NIL);
+	tree->err[s] = from_list(tree, scmd->err, scmd->out, tree->out[s]);
+	for (d = scmd->dup; d != NULL; d = d->next)
+		tree->dup[s] = ct_append_dup(tree, tree->dup[s], d->fd, d->source,
+			d->before_files);
+	tree->io_flags[s] = (uint8_t)scmd->io_flags;
+
+	return s;
+}
+
+
+static ct_index_t from_command(ct_tree_t * tree, const command_t * c)
+{
+	ct_index_t cmd1, cmd2;
+
+	if (c->op == OP_NONE)
+		return ct_add_command(tree, OP_NONE, CT_NIL, CT_NIL, from_simple(tree, c->scmd));
+
+	cmd1 = from_command(tree, c->cmd1);
+	if (c->op == OP_BRACE_GROUP || c->op == OP_SUBSHELL)
+		return ct_add_command(tree, c->op, cmd1, CT_NIL, from_simple(tree, c->scmd));
+
+	cmd2 = from_command(tree, c->cmd2);
+	return ct_add_command(tree, c->op, cmd1, cmd2, CT_NIL);
+}
+
+
+ct_index_t ct_from_command(ct_tree_t * tree, const command_t * root)
+{
+	ct_clear(tree);
+	if (root != NULL)
+		tree->root = from_command(tree, root);
+
+	return tree->root;
+}
+
+
+/*
+ * Conversion to parser.h structures
+ */
+
+size_t ct_command_size(const ct_tree_t * tree)
+{
+	return tree->command_count * sizeof(command_t) +
+		tree->simple_count * sizeof(simple_command_t) +
+		tree->part_count * sizeof(word_t) +
+		tree->dup_count * sizeof(dup_t);
+}
+
+
+command_t * ct_to_command(const ct_tree_t * tree, void * memory)
+{
+	command_t * commands = (command_t *)memory;
+	simple_command_t * simples = (simple_command_t *)(commands + tree->command_count);
+	word_t * words = (word_t *)(simples + tree->simple_count);
+	dup_t * dups = (dup_t *)(words + tree->part_count);
+	size_t i;
+
+	for (i = 0; i < tree->part_count; i++) {
+		words[i].string = CT_PART_STRING(tree, i);
+		words[i].length = tree->part_length[i];
+		words[i].expand = tree->part_expand[i] ? true : false;
+		words[i].next_part = NODE(words, tree->next_part[i]);
+		words[i].next_word = NODE(words, tree->next_word[i]);
+	}
+
+	for (i = 0; i < tree->dup_count; i++) {
+		dups[i].fd = tree->dup_fd[i];
+		dups[i].source = tree->dup_source[i];
+		dups[i].before_files = tree->dup_before_files[i] ? true : false;
+		dups[i].next = NODE(dups, tree->next_dup[i]);
+	}
+
+	for (i = 0; i < tree->simple_count; i++) {
+		simples[i].verb = NODE(words, tree->verb[i]);
+		simples[i].params = NODE(words, tree->params[i]);
+		simples[i].in = NODE(words, tree->in[i]);
+		simples[i].out = NODE(words, tree->out[i]);
+		simples[i].err = NODE(words, tree->err[i]);
+		simples[i].dup = NODE(dups, tree->dup[i]);
+		simples[i].io_flags = tree->io_flags[i];
+		simples[i].up = NODE(commands, tree->scmd_up[i]);
+		simples[i].aux = NULL;
+	}
+
+	for (i = 0; i < tree->command_count; i++) {
+		commands[i].up = NODE(commands, tree->up[i]);
+		commands[i].cmd1 = NODE(commands, tree->cmd1[i]);
+		commands[i].cmd2 = NODE(commands, tree->cmd2[i]);
+		commands[i].op = (operator_t)tree->op[i];
+		commands[i].scmd = NODE(simples, tree->scmd[i]);
+		commands[i].aux = NULL;
+	}
+
+	return NODE(commands, tree->root);
+}
@@ -0,0 +1,194 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+
+#ifndef __CTREE_H
+#define __CTREE_H
+
+/*
+ * Compact parse tree
+
+ * The same tree as the one made of command_t, simple_command_t and word_t
+ * (see parser.h), with every kind of node stored as a structure of arrays
+ * and the links between nodes as 32-bit indices (CT_NIL for NULL). The
+ * text of the word parts is kept, NUL terminated, in a single string pool
+ * and referred to by (offset, length).
+
+ * Node i of a kind is made of the i-th element of each array of that
+ * kind, e.g. the parts of the verb of simple command s are
+ * part_offset[verb[s]], part_offset[next_part[verb[s]]], ...
+
+ * The hand-written parser (rdparser.h) builds this tree directly;
+ * ct_from_command() builds it from any parse_line() tree and
+ * ct_to_command() turns it back into parser.h structures.
+ */
+
+#include <stdint.h>
+#include "parser.h"
+
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+typedef uint32_t ct_index_t;
+
+#define CT_NIL	((ct_index_t)0xffffffff)
+
+
+typedef struct {
+	/* word parts (word_t) */
+	uint32_t * part_offset;
+	uint32_t * part_length;
+	uint8_t * part_expand;
+	ct_index_t * next_part;
+	ct_index_t * next_word;
+	size_t part_count;
+	size_t part_capacity;
+
+	/* descriptor duplications (dup_t) */
+	int8_t * dup_fd;
+	int8_t * dup_source;
+	uint8_t * dup_before_files;
+	ct_index_t * next_dup;
+	size_t dup_count;
+	size_t dup_capacity;
+
+	/* simple commands (simple_command_t) */
+	ct_index_t * verb;
+	ct_index_t * params;
+	ct_index_t * in;
+	ct_index_t * out;
+	ct_index_t * err;
+	ct_index_t * dup;
+	uint8_t * io_flags;
+	ct_index_t * scmd_up;
+	size_t simple_count;
+	size_t simple_capacity;
+
+	/* commands (command_t) */
+	uint8_t * op;
+	ct_index_t * cmd1;
+	ct_index_t * cmd2;
+	ct_index_t * scmd;
+	ct_index_t * up;
+	size_t command_count;
+	size_t command_capacity;
+
+	/* text of the parts */
+	char * pool;
+	size_t pool_size;
+	size_t pool_capacity;
+
+	/* root command (CT_NIL for an empty line) */
+	ct_index_t root;
+} ct_tree_t;
+
+
+/*
+ * Text of part i (NUL terminated, part_length[i] bytes)
+ */
+
+#define CT_PART_STRING(tree, i)	((tree)->pool + (tree)->part_offset[i])
+
+
+/*
+ * Initialize an empty tree
+ */
+
+void ct_init(ct_tree_t * tree);
+
+
+/*
+ * Remove all the nodes (the memory is kept for the next tree)
+ */
+
+void ct_clear(ct_tree_t * tree);
+
+
+/*
+ * Free the memory of a tree
+ */
+
+void ct_free(ct_tree_t * tree);
+
+
+/*
+ * Add a word part (a word of a single part, next_part and next_word are
+ * CT_NIL) with a copy of len bytes of str
+ */
+
+ct_index_t ct_add_part(ct_tree_t * tree, const char * str, size_t len, bool expand);
+
+
+/*
+ * Append the word w to the list of words that starts with lst (CT_NIL for
+ * an empty list), the same way the parser appends to the in, out and err
+ * lists; returns the (new) start of the list
+ */
+
+ct_index_t ct_append_word(ct_tree_t * tree, ct_index_t lst, ct_index_t w);
+
+
+/*
+ * Append a duplication of source to fd (-1 to close fd), entered before the
+ * file redirections of its command if before_files, to the list that
+ * starts with lst (CT_NIL for an empty list); returns the (new) start of
+ * the list
+ */
+
+ct_index_t ct_append_dup(ct_tree_t * tree, ct_index_t lst, int fd, int source,
+	bool before_files);
+
+
+/*
+ * Add a simple command without redirections (in, out, err and dup are
+ * CT_NIL)
+ */
+
+ct_index_t ct_add_simple(ct_tree_t * tree, ct_index_t verb, ct_index_t params);
+
+
+/*
+ * Add a command: a simple command (op == OP_NONE), a group of cmd1 with
+ * the redirections of scmd (verb and params CT_NIL) or cmd1 op cmd2; the
+ * up links of the children point to it
+ */
+
+ct_index_t ct_add_command(ct_tree_t * tree, operator_t op, ct_index_t cmd1,
+	ct_index_t cmd2, ct_index_t scmd);
+
+
+/*
+ * Replace tree with a copy of the tree of root (a parse_line() result,
+ * possibly NULL); sets and returns tree->root
+ */
+
+ct_index_t ct_from_command(ct_tree_t * tree, const command_t * root);
+
+
+/*
+ * Bytes needed by ct_to_command() for tree
+ */
+
+size_t ct_command_size(const ct_tree_t * tree);
+
+
+/*
+ * Build the parser.h structures of tree in memory (ct_command_size()
+ * bytes, suitably aligned, e.g. from malloc()); returns the command of
+ * tree->root (NULL for an empty line)
+
+ * The strings of the words point into the pool of tree, which must not be
+ * changed or freed while the result is in use.
+ */
+
+command_t * ct_to_command(const ct_tree_t * tree, void * memory);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
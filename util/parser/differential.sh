@@ -0,0 +1,108 @@
+#!/bin/bash
+# SPDX-License-Identifier: BSD-3-Clause
+#
+# Differential test of two parser implementations.
+#
+# Every input line is run through the DisplayStructure of both parsers and
+# the tree dumps (and error messages) must be identical. A parser is either
+# a DisplayStructure executable or a backend name known to the Makefile
+# (bison, rd), built in a scratch copy of this directory.
+#
+# With -b the lines the first parser accepts are also checked with
+# "bash -n": the parser only knows a subset of the shell language, so bash
+# must accept all of them (with the fan-out operator |>, which bash lacks,
+# written as a pipe).
+#
+# Usage: ./differential.sh [-b] PARSER_A PARSER_B [file...]
+#   file  - one command per line (default tests/*.txt)
+#   FUZZ  - number of random lines to add (default 10000)
+#   SEED  - seed of the random lines (default 1)
+
+PARSER_DIR=$(cd "$(dirname "$0")" && pwd)
+FUZZ=${FUZZ:-10000}
+SEED=${SEED:-1}
+CHECK_BASH=no
+
+if [ "$1" = "-b" ]; then
+	CHECK_BASH=yes
+	shift
+fi
+
+if [ $# -lt 2 ]; then
+	echo "Usage: $0 [-b] PARSER_A PARSER_B [file...]" 1>&2
+	exit 1
+fi
+
+WORK_DIR=$(mktemp -d)
+trap 'rm -rf "$WORK_DIR"' EXIT
+
+# Print the DisplayStructure of a parser, building it if needed.
+display_structure() {
+	local parser=$1
+
+	if [ -x "$parser" ]; then
+		echo "$(cd "$(dirname "$parser")" && pwd)/$(basename "$parser")"
+		return
+	fi
+
+	mkdir -p "$WORK_DIR/$parser"
+	cp "$PARSER_DIR"/Makefile "$PARSER_DIR"/*.[chly] "$PARSER_DIR"/*.cpp "$WORK_DIR/$parser"
+	rm -f "$WORK_DIR/$parser"/parser.tab.[ch] "$WORK_DIR/$parser"/parser.yy.c
+	if ! make -s -C "$WORK_DIR/$parser" PARSER="$parser" >/dev/null 2>&1; then
+		echo "Cannot build the $parser parser" 1>&2
+		exit 1
+	fi
+	echo "$WORK_DIR/$parser/DisplayStructure"
+}
+
+# Random lines made of the tokens of the grammar and a few invalid ones.
+random_lines() {
+	awk -v count="$FUZZ" -v seed="$SEED" 'BEGIN {
+		n = split("a@b2@2@x=y@=@$@$v@$_x1@2>@2>>@>@>>@<@&>@&@&&@;@|@||@|>@'"'"'q r'"'"'@\"w $v\"@'"'"'@\"@%@*@~/p@-o@\r@#@(@)@{@}@2>&1@>&2@<&-@3>&-@ @  @\t", tok, "@")
+		srand(seed)
+		for (i = 0; i < count; i++) {
+			line = ""
+			len = 1 + int(rand() * 12)
+			for (j = 0; j < len; j++)
+				line = line tok[1 + int(rand() * n)]
+			print line
+		}
+	}'
+}
+
+DISPLAY_A=$(display_structure "$1") || exit 1
+DISPLAY_B=$(display_structure "$2") || exit 1
+shift 2
+
+if [ $# -eq 0 ]; then
+	set -- "$PARSER_DIR"/tests/*.txt
+fi
+cat "$@" > "$WORK_DIR/lines"
+random_lines >> "$WORK_DIR/lines"
+
+"$DISPLAY_A" < "$WORK_DIR/lines" > "$WORK_DIR/a.out" 2>&1
+"$DISPLAY_B" < "$WORK_DIR/lines" > "$WORK_DIR/b.out" 2>&1
+
+status=0
+if ! diff -u "$WORK_DIR/a.out" "$WORK_DIR/b.out" > "$WORK_DIR/diff"; then
+	echo "The parsers disagree:"
+	head -n 40 "$WORK_DIR/diff"
+	status=1
+fi
+
+if [ "$CHECK_BASH" = "yes" ]; then
+	# A dump is "> line", then "Command successfully read!" when accepted
+	awk '/^> / { line = substr($0, 3) } /^Command successfully read!$/ { print line }' \
+		"$WORK_DIR/a.out" > "$WORK_DIR/accepted"
+	while IFS= read -r line; do
+		if ! printf "%s\n" "${line//|>/|}" | bash -n 2>/dev/null; then
+			echo "Accepted by the parser, rejected by bash: $line"
+			status=1
+		fi
+	done < "$WORK_DIR/accepted"
+fi
+
+if [ $status -eq 0 ]; then
+	echo "$(wc -l < "$WORK_DIR/lines") lines, no difference"
+fi
+exit $status
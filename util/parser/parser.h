@@ -20,6 +20,13 @@
 
 
 
+#ifdef __cplusplus
+#include <cstddef>
+#else
+#include <stddef.h>
+#endif
+
+
 #ifdef __cplusplus
 #else
 /*
@@ -47,6 +54,11 @@ typedef enum {
  * Some parts might need environment variable expansion (expand == true);
  * if that is the case, "string" points to the environment variable name
 
+ * "string" points to "length" characters and is NOT '\0' terminated; the
+ * lexer makes no copies, the characters are those of the line given to the
+ * parser, which must therefore stay unchanged until free_parse_memory()
+ * is called
+
  * The next string literal is pointed to by next_word
  * (NULL if there are no more list elements)
 
@@ -67,9 +79,32 @@ typedef struct word_t {
 	bool expand;
 	struct word_t *next_part;
 	struct word_t *next_word;
+	size_t length;
 } word_t;
 
 
+/*
+ * Descriptor duplication list
+
+ * fd is made a copy of source ("fd>&source" or "fd<&source"), or closed
+ * when source == -1 ("fd>&-"); both are single digits, fd defaults to 1
+ * for ">&" and to 0 for "<&"
+
+ * before_files is true if the duplication was entered before all the in,
+ * out and err redirections of the command (e.g. cmd 2>&1 >out)
+
+ * The next duplication is pointed to by next (NULL if there are no more
+ * list elements), in the original order
+ */
+
+typedef struct dup_t {
+	int fd;
+	int source;
+	bool before_files;
+	struct dup_t *next;
+} dup_t;
+
+
 /*
  * Describes a simple command
 
@@ -79,7 +114,8 @@ typedef struct word_t {
  * aux.
 
  * verb points to a single string literal (possibly made up of parts)
- * that is the executable name or the internal command name.
+ * that is the executable name or the internal command name (NULL when
+ * the structure only holds the redirections of a group, see below).
 
  * params points to a list of parameters (possibly none) in the order
  * they were entered in the command line.
@@ -91,6 +127,12 @@ typedef struct word_t {
  * latter as you wish (e.g. only consider the first redirection). Within
  * any of these lists, the literals are in the original order.
 
+ * dup points to the descriptor duplications of the command (possibly
+ * none), done after the in, out and err redirections with no file opened
+ * (e.g. cat >out 2>&1 sends stderr to the file stdout was redirected to),
+ * except for those entered before all of them, done first (cat 2>&1 >out
+ * sends stderr where stdout was)
+
  * io_flags is used to specify special modes for redirection (e.g. appending)
 
  * Some string literals can be found in both the out list and the err list
@@ -110,6 +152,7 @@ typedef struct {
 	word_t *in;
 	word_t *out;
 	word_t *err;
+	dup_t *dup;
 	int io_flags;
 	struct command_t *up;
 	void *aux;
@@ -122,6 +165,14 @@ typedef struct {
  * OP_NONE means no operator
  * (the scmd field points to a simple command and cmd1 == cmd2 == NULL)
 
+ * OP_BRACE_GROUP ({ cmd1 }) and OP_SUBSHELL (( cmd1 )) group a command
+ * (cmd2 == NULL); scmd holds the redirections of the group, applied once
+ * to all of cmd1 (verb == params == NULL)
+
+ * OP_FANOUT (cmd1 |> cmd2) binds less tightly than OP_PIPE; in a chain of
+ * them (p |> a |> b, left associative), the output of the leftmost command
+ * goes to every other one, instead of each feeding the next
+
  * The rest of the operators mean scmd == NULL
 
  * OP_DUMMY is a dummy value that can be used to count the number of operators
@@ -134,6 +185,9 @@ typedef enum {
 	OP_CONDITIONAL_ZERO,
 	OP_CONDITIONAL_NZERO,
 	OP_PIPE,
+	OP_BRACE_GROUP,
+	OP_SUBSHELL,
+	OP_FANOUT,
 	OP_DUMMY
 } operator_t;
 
@@ -145,6 +199,12 @@ typedef enum {
       scmd != NULL
       cmd1 == cmd2 == NULL
       scmd points to a command to be executed
+ *  else if (op == OP_BRACE_GROUP || op == OP_SUBSHELL)
+      scmd != NULL
+      cmd1 != NULL
+      cmd2 == NULL
+      cmd1 must be executed with the redirections of scmd, in the shell
+      for OP_BRACE_GROUP and in a child process for OP_SUBSHELL
  *  else
       scmd == NULL
       cmd1 != NULL
@@ -157,12 +217,13 @@ typedef enum {
  * (the father of the current node in the parse tree)
  * The root of the tree has up == NULL
 
- * The parsed expressions do not contain parantheses, this means that
- * the following holds:
+ * Apart from groups, the parsed expressions do not contain parantheses,
+ * this means that the following holds:
  * for any op_lower that has a lower priority than op, there is no
- * parent in the tree with op == op_lower
+ * parent in the tree with op == op_lower, up to the nearest group
  * In particular, if op == OP_PIPE descendants
- * can only have OP_PIPE or OP_NONE
+ * can only have OP_PIPE, OP_NONE or a group (whose descendants can be
+ * anything again)
  */
 
 typedef struct command_t {
@@ -204,11 +265,31 @@ void parse_error(const char *str, const int where);
  * if parse_line returns true:
  *   if line was empty (or contained just blanks) (*root) is NULL
  *   else (*root) points to the root of the parse tree
+
+ * The strings of the tree point into line (see word_t), which must outlive
+ * the tree
  */
 
 bool parse_line(const char *line, command_t **root);
 
 
+/*
+ * Same as parse_line, but the line is scanned in place instead of being
+ * copied by the lexer
+
+ * buffer must hold a single line followed by two '\0' bytes, size counts
+ * both of them (size == strlen(buffer) + 2); the line itself must not
+ * contain the end of line characters
+
+ * The lexer temporarily writes into buffer while scanning it, so the caller
+ * must not rely on its contents until free_parse_memory() is called; the
+ * strings of the tree point into buffer (restored once the whole line is
+ * read), as they point into line for parse_line
+ */
+
+bool parse_line_buffer(char *buffer, size_t size, command_t **root);
+
+
 /*
  * Should be called to free the parse tree
  * call this even if parse_line() returned false
@@ -229,10 +310,17 @@ void free_parse_memory(void);
 
 typedef void *GenericPointer;
 
+/* A WORD or ENV_VAR token: a view of the line being parsed */
+typedef struct {
+	const char *string;
+	size_t length;
+} token_t;
+
 typedef struct {
 	word_t *red_i;
 	word_t *red_o;
 	word_t *red_e;
+	dup_t *red_d;
 	int red_flags;
 } redirect_t;
 
@@ -245,6 +333,7 @@ extern "C"
 void pointerToMallocMemory(const void *ptr);
 int yylex(void);
 void globalParseAnotherString(const char *str);
+void globalParseAnotherBuffer(char *buffer, size_t size);
 void globalEndParsing(void);
 
 #ifdef __cplusplus
@@ -32,6 +32,10 @@ using namespace std;
 #define __PARSER_H_INTERNAL_INCLUDE
 #include "parser.h"
 
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
 
 static GenericPointer * globalAllocMem = NULL;
 static size_t globalAllocCount = 0;
@@ -101,6 +105,7 @@ static simple_command_t * bind_parts(word_t * exe_name, word_t * params, redirec
 	s->in = red.red_i;
 	s->out = red.red_o;
 	s->err = red.red_e;
+	s->dup = red.red_d;
 	s->io_flags = red.red_flags;
 	s->up = NULL;
 	s->aux = NULL;
@@ -154,14 +159,50 @@ static command_t * bind_commands(command_t * cmd1, command_t * cmd2, operator_t
 }
 
 
-static word_t * new_word(const char * str, bool expand)
+static command_t * bind_group(command_t * body, operator_t op, redirect_t red)
+{
+	command_t * c = (command_t *) malloc(sizeof(command_t));
+	simple_command_t * s = (simple_command_t *) malloc(sizeof(simple_command_t));
+	pointerToMallocMemory(c);
+	pointerToMallocMemory(s);
+
+	/* the redirections of the group, without a command */
+	memset(s, 0, sizeof(*s));
+	s->verb = NULL;
+	s->params = NULL;
+	s->in = red.red_i;
+	s->out = red.red_o;
+	s->err = red.red_e;
+	s->dup = red.red_d;
+	s->io_flags = red.red_flags;
+	s->up = c;
+	s->aux = NULL;
+
+	memset(c, 0, sizeof(*c));
+	c->up = NULL;
+	assert(body != NULL);
+	assert(body->up == NULL);
+	c->cmd1 = body;
+	body->up = c;
+	c->cmd2 = NULL;
+	assert((op == OP_BRACE_GROUP) || (op == OP_SUBSHELL));
+	c->op = op;
+	c->scmd = s;
+	c->aux = NULL;
+
+	return c;
+}
+
+
+static word_t * new_word(token_t token, bool expand)
 {
 	word_t * w = (word_t *) malloc(sizeof(word_t));
 	pointerToMallocMemory(w);
 
 	memset(w, 0, sizeof(*w));
-	assert(str != NULL);
-	w->string = str;
+	assert(token.string != NULL);
+	w->string = token.string;
+	w->length = token.length;
 	w->expand = expand;
 	w->next_part = NULL;
 	w->next_word = NULL;
@@ -213,6 +254,13 @@ static word_t * add_word_to_list(word_t * w, word_t * lst)
 		crt = crt->next_word;
 	}
 
+	/*
+	 words of "&>" are in both the out and the err list, so after
+	 a second "&>" the word is already at the end of the other one
+	*/
+	if (crt == w)
+		return lst;
+
 	crt->next_word = w;
 	assert(w->next_word == NULL);
 
@@ -220,11 +268,49 @@ static word_t * add_word_to_list(word_t * w, word_t * lst)
 }
 
 
+/* [N]>&M, [N]<&M, [N]>&- or [N]<&- (see parser.l) */
+static dup_t * new_dup(token_t token, redirect_t * red)
+{
+	dup_t * d = (dup_t *) malloc(sizeof(dup_t));
+	char last = token.string[token.length - 1];
+	pointerToMallocMemory(d);
+
+	memset(d, 0, sizeof(*d));
+	assert(token.length == 3 || token.length == 4);
+	if (token.length == 4)
+		d->fd = token.string[0] - '0';
+	else
+		d->fd = token.string[0] == '<' ? 0 : 1;
+	d->source = last == '-' ? -1 : last - '0';
+	d->before_files = red->red_i == NULL && red->red_o == NULL &&
+		red->red_e == NULL;
+	d->next = NULL;
+
+	return d;
+}
+
+
+static dup_t * add_dup_to_list(dup_t * d, dup_t * lst)
+{
+	dup_t * crt = lst;
+	assert(d != NULL);
+
+	if (crt == NULL)
+		return d;
+
+	while (crt->next != NULL)
+		crt = crt->next;
+	crt->next = d;
+
+	return lst;
+}
+
+
 %}
 
 %union {
 	command_t * command_un;
-	const char * string_un;
+	token_t token_un;
 	redirect_t redirect_un;
 	simple_command_t * simple_command_un;
 	word_t * exe_un;
@@ -237,15 +323,21 @@ static word_t * add_word_to_list(word_t * w, word_t * lst)
 %token END_OF_FILE END_OF_LINE BLANK
 %token REDIRECT_OE REDIRECT_O REDIRECT_E INDIRECT
 %token REDIRECT_APPEND_E REDIRECT_APPEND_O
-%token <string_un> WORD
-%token <string_un> ENV_VAR
+%token BRACE_OPEN BRACE_CLOSE PAREN_OPEN PAREN_CLOSE
+%token <token_un> WORD
+%token <token_un> ENV_VAR
+%token <token_un> DUPLICATE
 
 %left SEQUENTIAL
 %left PARALLEL
 %left CONDITIONAL_NZERO CONDITIONAL_ZERO
+%left FANOUT
 %left PIPE
 
 %type <command_un> command
+%type <command_un> group
+%type <command_un> brace_body
+%type <command_un> subshell_body
 %type <exe_un> exe_name
 %type <params_un> params
 %type <redirect_un> redirect
@@ -316,6 +408,79 @@ command:
 		$$ = bind_commands($1, $3, OP_PIPE);
 	}
 
+	| command FANOUT command {
+		$$ = bind_commands($1, $3, OP_FANOUT);
+	}
+
+	| group {
+		$$ = $1;
+	}
+
+	;
+
+group:
+
+	  BRACE_OPEN BLANK brace_body BRACE_CLOSE redirect {
+		$$ = bind_group($3, OP_BRACE_GROUP, $5);
+	}
+
+	| BRACE_OPEN BLANK brace_body BRACE_CLOSE BLANK redirect {
+		$$ = bind_group($3, OP_BRACE_GROUP, $6);
+	}
+
+	| BLANK BRACE_OPEN BLANK brace_body BRACE_CLOSE redirect {
+		$$ = bind_group($4, OP_BRACE_GROUP, $6);
+	}
+
+	| BLANK BRACE_OPEN BLANK brace_body BRACE_CLOSE BLANK redirect {
+		$$ = bind_group($4, OP_BRACE_GROUP, $7);
+	}
+
+	| PAREN_OPEN subshell_body PAREN_CLOSE redirect {
+		$$ = bind_group($2, OP_SUBSHELL, $4);
+	}
+
+	| PAREN_OPEN subshell_body PAREN_CLOSE BLANK redirect {
+		$$ = bind_group($2, OP_SUBSHELL, $5);
+	}
+
+	| BLANK PAREN_OPEN subshell_body PAREN_CLOSE redirect {
+		$$ = bind_group($3, OP_SUBSHELL, $5);
+	}
+
+	| BLANK PAREN_OPEN subshell_body PAREN_CLOSE BLANK redirect {
+		$$ = bind_group($3, OP_SUBSHELL, $6);
+	}
+
+	;
+
+/* as in sh, '{' is followed by a blank and '}' by a ';' */
+brace_body:
+
+	  command SEQUENTIAL {
+		$$ = $1;
+	}
+
+	| command SEQUENTIAL BLANK {
+		$$ = $1;
+	}
+
+	;
+
+subshell_body:
+
+	  command {
+		$$ = $1;
+	}
+
+	| command SEQUENTIAL {
+		$$ = $1;
+	}
+
+	| command SEQUENTIAL BLANK {
+		$$ = $1;
+	}
+
 	;
 
 simple_command:
@@ -368,6 +533,7 @@ redirect:
 		$$.red_o = NULL;
 		$$.red_i = NULL;
 		$$.red_e = NULL;
+		$$.red_d = NULL;
 		$$.red_flags = IO_REGULAR;
 	}
 
@@ -502,6 +668,16 @@ redirect:
 		$$ = $1;
 	}
 
+	| redirect DUPLICATE {
+		$1.red_d = add_dup_to_list(new_dup($2, &$1), $1.red_d);
+		$$ = $1;
+	}
+
+	| redirect DUPLICATE BLANK {
+		$1.red_d = add_dup_to_list(new_dup($2, &$1), $1.red_d);
+		$$ = $1;
+	}
+
 	;
 
 word:
@@ -526,6 +702,244 @@ word:
 %%
 
 
+/*
+ * Fast path for the most common lines: plain words (WORD, '=' and ENV_VAR
+ * parts) separated by blanks, with an optional newline at the end. Such a
+ * line is a single simple command without redirections, so its tree is
+ * built directly. A vectorised scan skips over runs of word characters;
+ * any other character sends the whole line to flex and bison.
+ */
+
+/*
+ * Characters of parameterValue in parser.l; with plain set, also the
+ * blanks, '=' and '$' that may appear in a plain line.
+ */
+static bool is_word_char(unsigned char c, bool plain)
+{
+	return (c >= '*' && c <= ':') || (c >= 'A' && c <= 'Z') ||
+		(c >= 'a' && c <= 'z') || c == '%' || c == '?' || c == '\\' ||
+		c == '_' || c == '~' ||
+		(plain && (c == ' ' || c == '\t' || c == '=' || c == '$'));
+}
+
+
+/* Characters of envVarName in parser.l. */
+static bool is_name_char(unsigned char c, bool first)
+{
+	return c == '_' || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') ||
+		(!first && c >= '0' && c <= '9');
+}
+
+
+#if defined(__AVX2__)
+/* Lanes of v in [lo, hi] (bytes above 0x7f never are). */
+static __m256i in_range_avx2(__m256i v, char lo, char hi)
+{
+	return _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8(lo - 1)),
+		_mm256_cmpgt_epi8(_mm256_set1_epi8(hi + 1), v));
+}
+
+
+static unsigned int word_mask_avx2(const char * p, bool plain)
+{
+	__m256i v = _mm256_loadu_si256((const __m256i *)p);
+	__m256i m = _mm256_or_si256(in_range_avx2(v, '*', ':'),
+		_mm256_or_si256(in_range_avx2(v, 'A', 'Z'), in_range_avx2(v, 'a', 'z')));
+
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('%')));
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('?')));
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\')));
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_')));
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('~')));
+	if (plain) {
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t')));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('=')));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('$')));
+	}
+
+	return (unsigned int)_mm256_movemask_epi8(m);
+}
+#endif
+
+
+#if defined(__SSE2__)
+/* Lanes of v in [lo, hi] (bytes above 0x7f never are). */
+static __m128i in_range_sse2(__m128i v, char lo, char hi)
+{
+	return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(lo - 1)),
+		_mm_cmplt_epi8(v, _mm_set1_epi8(hi + 1)));
+}
+
+
+static unsigned int word_mask_sse2(const char * p, bool plain)
+{
+	__m128i v = _mm_loadu_si128((const __m128i *)p);
+	__m128i m = _mm_or_si128(in_range_sse2(v, '*', ':'),
+		_mm_or_si128(in_range_sse2(v, 'A', 'Z'), in_range_sse2(v, 'a', 'z')));
+
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('%')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('?')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('~')));
+	if (plain) {
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\t')));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('=')));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('$')));
+	}
+
+	return (unsigned int)_mm_movemask_epi8(m);
+}
+#endif
+
+
+/* Index of the first character from i on that is_word_char() rejects. */
+static size_t skip_word_chars(const char * line, size_t i, size_t len, bool plain)
+{
+#if defined(__AVX2__)
+	for (; i + 32 <= len; i += 32) {
+		unsigned int mask = ~word_mask_avx2(line + i, plain);
+
+		if (mask != 0)
+			return i + __builtin_ctz(mask);
+	}
+#endif
+#if defined(__SSE2__)
+	for (; i + 16 <= len; i += 16) {
+		unsigned int mask = ~word_mask_sse2(line + i, plain) & 0xffff;
+
+		if (mask != 0)
+			return i + __builtin_ctz(mask);
+	}
+#endif
+	while (i < len && is_word_char((unsigned char)line[i], plain))
+		i++;
+
+	return i;
+}
+
+
+/* Free what the fast path allocated before it gave up on a line. */
+static void release_since(size_t count)
+{
+	while (globalAllocCount > count) {
+		globalAllocCount--;
+		free(globalAllocMem[globalAllocCount]);
+		globalAllocMem[globalAllocCount] = NULL;
+	}
+}
+
+
+/* Append a part to the word being built, or start it. */
+static word_t * add_part(word_t * word, word_t ** last_part, const char * str, size_t len, bool expand)
+{
+	token_t token;
+	word_t * w;
+
+	token.string = str;
+	token.length = len;
+	w = new_word(token, expand);
+	if (word == NULL)
+		word = w;
+	else
+		(*last_part)->next_part = w;
+	*last_part = w;
+
+	return word;
+}
+
+
+static bool fast_parse(const char * line, size_t len, command_t ** root)
+{
+	size_t mark = globalAllocCount, i = 0;
+	word_t * verb = NULL, * params = NULL, * last_param = NULL;
+	word_t * word = NULL, * last_part = NULL;
+	redirect_t red;
+
+	if (len > 0 && line[len - 1] == '\n') {
+		len--;
+		if (len > 0 && line[len - 1] == '\r')
+			len--;
+	}
+
+	/* a first pass over the whole line looks for anything else */
+	if (skip_word_chars(line, 0, len, true) != len)
+		return false;
+
+	needsFree = true;
+
+	while (i <= len) {
+		size_t end = skip_word_chars(line, i, len, false);
+
+		if (end > i) {
+			word = add_part(word, &last_part, line + i, end - i, false);
+			i = end;
+			continue;
+		}
+
+		if (i == len || line[i] == ' ' || line[i] == '\t') {
+			/* a blank (or the end) finishes the word being built */
+			if (word != NULL && verb == NULL) {
+				verb = word;
+			} else if (word != NULL) {
+				if (params == NULL)
+					params = word;
+				else
+					last_param->next_word = word;
+				last_param = word;
+			}
+			word = NULL;
+			i++;
+		} else if (line[i] == '=') {
+			word = add_part(word, &last_part, line + i, 1, false);
+			i++;
+		} else if (line[i] == '$' && i + 1 < len && is_name_char((unsigned char)line[i + 1], true)) {
+			for (end = i + 2; end < len && is_name_char((unsigned char)line[end], false); end++)
+				;
+			word = add_part(word, &last_part, line + i + 1, end - i - 1, true);
+			i = end;
+		} else {
+			/* '$' without a name */
+			release_since(mark);
+			return false;
+		}
+	}
+
+	if (verb == NULL) {
+		*root = NULL;
+		return true;
+	}
+
+	red.red_i = red.red_o = red.red_e = NULL;
+	red.red_d = NULL;
+	red.red_flags = IO_REGULAR;
+	*root = new_command(bind_parts(verb, params, red));
+
+	return true;
+}
+
+
+static bool run_parser(command_t ** root)
+{
+	needsFree = true;
+	command_root = NULL;
+
+	yylloc.first_line = yylloc.last_line = 1;
+	yylloc.first_column = yylloc.last_column = 0;
+
+	if (yyparse() != 0) {
+		/* yyparse failed */
+		return false;
+	}
+
+	*root = command_root;
+
+	return true;
+}
+
+
 bool parse_line(const char * line, command_t ** root)
 {
 	if (*root != NULL) {
@@ -541,21 +955,34 @@ bool parse_line(const char * line, command_t ** root)
 	}
 
 	free_parse_memory();
+	if (fast_parse(line, strlen(line), root))
+		return true;
 	globalParseAnotherString(line);
-	needsFree = true;
-	command_root = NULL;
 
-	yylloc.first_line = yylloc.last_line = 1;
-	yylloc.first_column = yylloc.last_column = 0;
+	return run_parser(root);
+}
 
-	if (yyparse() != 0) {
-		/* yyparse failed */
+
+bool parse_line_buffer(char * buffer, size_t size, command_t ** root)
+{
+	if (*root != NULL) {
+		/* see the comment in parser.h */
+		assert(false);
 		return false;
 	}
 
-	*root = command_root;
+	if (buffer == NULL || size < 2 || buffer[size - 2] != '\0' || buffer[size - 1] != '\0') {
+		/* see the comment in parser.h */
+		assert(false);
+		return false;
+	}
 
-	return true;
+	free_parse_memory();
+	if (fast_parse(buffer, size - 2, root))
+		return true;
+	globalParseAnotherBuffer(buffer, size);
+
+	return run_parser(root);
 }
 
 
@@ -0,0 +1,786 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+ * Hand-written recursive-descent parser, an alternative to parser.y and
+ * parser.l (build with make PARSER=rd).
+
+ * It accepts the same language, builds the same trees and reports syntax
+ * errors at the same column as the bison parser, but keeps all its state
+ * in a rd_context_t and scans the line once, in place. The tree is built
+ * as a compact tree (ctree.h), whose arrays are kept from one line to the
+ * next; parse_line() turns it into parser.h structures in one block.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "parser.h"
+#include "ctree.h"
+#include "rdparser.h"
+
+
+/* Tokens, as returned by the rules of parser.l */
+typedef enum {
+	TOK_WORD,
+	TOK_ENV_VAR,
+	TOK_BLANK,
+	TOK_END_OF_LINE,
+	TOK_END_OF_FILE,
+	TOK_SEQUENTIAL,
+	TOK_PARALLEL,
+	TOK_CONDITIONAL_ZERO,
+	TOK_CONDITIONAL_NZERO,
+	TOK_PIPE,
+	TOK_FANOUT,
+	TOK_REDIRECT_OE,
+	TOK_REDIRECT_O,
+	TOK_REDIRECT_E,
+	TOK_REDIRECT_APPEND_O,
+	TOK_REDIRECT_APPEND_E,
+	TOK_INDIRECT,
+	TOK_DUPLICATE,
+	TOK_BRACE_OPEN,
+	TOK_BRACE_CLOSE,
+	TOK_PAREN_OPEN,
+	TOK_PAREN_CLOSE,
+	/* NOT_ACCEPTED_CHAR, INVALID_ENVIRONMENT_VAR, UNEXPECTED_EOF, CHARS_AFTER_EOL */
+	TOK_INVALID
+} token_type_t;
+
+
+/* Lexer start conditions */
+typedef enum {
+	IN_INITIAL,
+	IN_SINGLE_QUOTES,
+	IN_DOUBLE_QUOTES
+} lexer_state_t;
+
+
+struct rd_context {
+	ct_tree_t tree;
+
+	/* parser.h structures of the tree */
+	void * nodes;
+	size_t nodes_size;
+
+	/* lexer */
+	const char * p;
+	const char * end;
+	lexer_state_t state;
+	int first_column;
+	int last_column;
+
+	/* lookahead token */
+	token_type_t type;
+	const char * text;
+	size_t len;
+	int column;
+
+	/* groups being parsed, and whether the last group body ended with ';' */
+	int depth;
+	bool sequential_end;
+
+	bool failed;
+	int error_column;
+};
+
+
+/*
+ * Lexer
+ */
+
+static bool is_name_char(char c, bool first)
+{
+	return c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+		(!first && c >= '0' && c <= '9');
+}
+
+
+/* parameterValue in parser.l */
+static bool is_word_char(char c)
+{
+	switch (c) {
+	case '-': case '\\': case '+': case ':': case '.':
+	case '_': case '%': case '?': case '*': case '~':
+	case '/': case ',':
+		return true;
+	default:
+		return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9');
+	}
+}
+
+
+/* Character at offset i from the current position ('\0' past the end) */
+static char peek(rd_context_t * ctx, size_t i)
+{
+	return ctx->p + i < ctx->end ? ctx->p[i] : '\0';
+}
+
+
+/* Consume n characters matched by a rule, like UPD_LOCATION */
+static void advance(rd_context_t * ctx, size_t n)
+{
+	ctx->first_column = ctx->last_column;
+	ctx->last_column += (int)n;
+	ctx->p += n;
+}
+
+
+static void set_token(rd_context_t * ctx, token_type_t type, size_t n)
+{
+	ctx->type = type;
+	advance(ctx, n);
+	ctx->column = ctx->first_column;
+}
+
+
+/* A WORD or ENV_VAR token of n characters, the first skip not being part of the text */
+static void set_text_token(rd_context_t * ctx, token_type_t type, size_t n, size_t skip)
+{
+	ctx->text = ctx->p + skip;
+	ctx->len = n - skip;
+	set_token(ctx, type, n);
+}
+
+
+/* End of input: the location is not updated (<<EOF>> rules) */
+static void set_eof_token(rd_context_t * ctx, token_type_t type)
+{
+	ctx->type = type;
+	ctx->column = ctx->first_column;
+}
+
+
+/* $name (ENV_VAR) or a lone $ (INVALID_ENVIRONMENT_VAR) */
+static void lex_dollar(rd_context_t * ctx)
+{
+	size_t n = 1;
+
+	if (!is_name_char(peek(ctx, 1), true)) {
+		set_token(ctx, TOK_INVALID, 1);
+		return;
+	}
+
+	while (ctx->p + n < ctx->end && is_name_char(ctx->p[n], false))
+		n++;
+	set_text_token(ctx, TOK_ENV_VAR, n, 1);
+}
+
+
+/* Length of a [N]>&M, [N]<&M, [N]>&- or [N]<&- token at the lexer (0 if none) */
+static size_t dup_length(rd_context_t * ctx)
+{
+	size_t n = peek(ctx, 0) >= '0' && peek(ctx, 0) <= '9' ? 1 : 0;
+	char source = peek(ctx, n + 2);
+
+	if ((peek(ctx, n) != '>' && peek(ctx, n) != '<') || peek(ctx, n + 1) != '&')
+		return 0;
+	if ((source < '0' || source > '9') && source != '-')
+		return 0;
+
+	return n + 3;
+}
+
+
+static void next_token(rd_context_t * ctx)
+{
+	for (;;) {
+		char c = peek(ctx, 0);
+		size_t n = 0;
+
+		if (ctx->state == IN_SINGLE_QUOTES) {
+			if (c == '\0') {
+				set_eof_token(ctx, TOK_INVALID);
+			} else if (c == '\'') {
+				ctx->state = IN_INITIAL;
+				advance(ctx, 1);
+				continue;
+			} else {
+				const char * q = (const char *)memchr(ctx->p, '\'', ctx->end - ctx->p);
+
+				n = (q != NULL ? q : ctx->end) - ctx->p;
+				set_text_token(ctx, TOK_WORD, n, 0);
+			}
+			return;
+		}
+
+		if (ctx->state == IN_DOUBLE_QUOTES) {
+			if (c == '\0') {
+				set_eof_token(ctx, TOK_INVALID);
+			} else if (c == '"') {
+				ctx->state = IN_INITIAL;
+				advance(ctx, 1);
+				continue;
+			} else if (c == '$') {
+				lex_dollar(ctx);
+			} else {
+				const char * q = ctx->p;
+
+				while (q < ctx->end && *q != '"' && *q != '$')
+					q++;
+				set_text_token(ctx, TOK_WORD, q - ctx->p, 0);
+			}
+			return;
+		}
+
+		/* longer than the word of the digit and than > and < */
+		if (dup_length(ctx) > 0) {
+			set_text_token(ctx, TOK_DUPLICATE, dup_length(ctx), 0);
+			return;
+		}
+
+		switch (c) {
+		case '\0':
+			set_eof_token(ctx, TOK_END_OF_FILE);
+			return;
+
+		case '\'':
+			ctx->state = IN_SINGLE_QUOTES;
+			advance(ctx, 1);
+			continue;
+
+		case '"':
+			ctx->state = IN_DOUBLE_QUOTES;
+			advance(ctx, 1);
+			continue;
+
+		case '\r':
+			if (peek(ctx, 1) != '\n')
+				set_token(ctx, TOK_INVALID, 1);
+			else if (peek(ctx, 2) != '\0')
+				set_token(ctx, TOK_INVALID, 3);
+			else
+				set_token(ctx, TOK_END_OF_LINE, 2);
+			return;
+
+		case '\n':
+			if (peek(ctx, 1) != '\0')
+				set_token(ctx, TOK_INVALID, 2);
+			else
+				set_token(ctx, TOK_END_OF_LINE, 1);
+			return;
+
+		case ';':
+			set_token(ctx, TOK_SEQUENTIAL, 1);
+			return;
+
+		case '|':
+			if (peek(ctx, 1) == '|')
+				set_token(ctx, TOK_CONDITIONAL_NZERO, 2);
+			else if (peek(ctx, 1) == '>')
+				set_token(ctx, TOK_FANOUT, 2);
+			else
+				set_token(ctx, TOK_PIPE, 1);
+			return;
+
+		case '&':
+			if (peek(ctx, 1) == '&')
+				set_token(ctx, TOK_CONDITIONAL_ZERO, 2);
+			else if (peek(ctx, 1) == '>')
+				set_token(ctx, TOK_REDIRECT_OE, 2);
+			else
+				set_token(ctx, TOK_PARALLEL, 1);
+			return;
+
+		case '>':
+			if (peek(ctx, 1) == '>')
+				set_token(ctx, TOK_REDIRECT_APPEND_O, 2);
+			else
+				set_token(ctx, TOK_REDIRECT_O, 1);
+			return;
+
+		case '<':
+			set_token(ctx, TOK_INDIRECT, 1);
+			return;
+
+		case '{':
+			set_token(ctx, TOK_BRACE_OPEN, 1);
+			return;
+
+		case '}':
+			set_token(ctx, TOK_BRACE_CLOSE, 1);
+			return;
+
+		case '(':
+			set_token(ctx, TOK_PAREN_OPEN, 1);
+			return;
+
+		case ')':
+			set_token(ctx, TOK_PAREN_CLOSE, 1);
+			return;
+
+		case ' ':
+		case '\t':
+			while (peek(ctx, n) == ' ' || peek(ctx, n) == '\t')
+				n++;
+			set_token(ctx, TOK_BLANK, n);
+			return;
+
+		case '=':
+			set_text_token(ctx, TOK_WORD, 1, 0);
+			return;
+
+		case '$':
+			lex_dollar(ctx);
+			return;
+
+		case '2':
+			/* 2> and 2>> are longer than the word "2" */
+			if (peek(ctx, 1) == '>') {
+				if (peek(ctx, 2) == '>')
+					set_token(ctx, TOK_REDIRECT_APPEND_E, 3);
+				else
+					set_token(ctx, TOK_REDIRECT_E, 2);
+				return;
+			}
+			break;
+
+		default:
+			break;
+		}
+
+		if (!is_word_char(c)) {
+			set_token(ctx, TOK_INVALID, 1);
+			return;
+		}
+
+		while (ctx->p + n < ctx->end && is_word_char(ctx->p[n]))
+			n++;
+		set_text_token(ctx, TOK_WORD, n, 0);
+		return;
+	}
+}
+
+
+/*
+ * Parser, building the same shapes as the actions in parser.y
+ */
+
+/* Syntax error at the lookahead token */
+static ct_index_t fail(rd_context_t * ctx)
+{
+	if (!ctx->failed) {
+		ctx->failed = true;
+		ctx->error_column = ctx->column;
+	}
+
+	return CT_NIL;
+}
+
+
+static bool is_word_token(rd_context_t * ctx)
+{
+	return ctx->type == TOK_WORD || ctx->type == TOK_ENV_VAR;
+}
+
+
+static bool is_redirect_token(rd_context_t * ctx)
+{
+	return ctx->type >= TOK_REDIRECT_OE && ctx->type <= TOK_DUPLICATE;
+}
+
+
+static bool is_close_token(rd_context_t * ctx)
+{
+	return ctx->type == TOK_BRACE_CLOSE || ctx->type == TOK_PAREN_CLOSE;
+}
+
+
+static ct_index_t new_part(rd_context_t * ctx)
+{
+	return ct_add_part(&ctx->tree, ctx->text, ctx->len, ctx->type == TOK_ENV_VAR ? true : false);
+}
+
+
+/* word: (WORD | ENV_VAR)+ */
+static ct_index_t parse_word(rd_context_t * ctx)
+{
+	ct_index_t first, last;
+
+	if (!is_word_token(ctx))
+		return fail(ctx);
+
+	first = last = new_part(ctx);
+	next_token(ctx);
+	while (is_word_token(ctx)) {
+		ct_index_t part = new_part(ctx);
+
+		ctx->tree.next_part[last] = part;
+		last = part;
+		next_token(ctx);
+	}
+
+	return first;
+}
+
+
+/*
+ * One redirection of simple command s: operator [BLANK] word [BLANK] or
+ * DUPLICATE [BLANK]
+ */
+static bool parse_redirect(rd_context_t * ctx, ct_index_t s)
+{
+	ct_tree_t * t = &ctx->tree;
+	token_type_t type = ctx->type;
+	ct_index_t w;
+
+	if (type == TOK_DUPLICATE) {
+		char last = ctx->text[ctx->len - 1];
+		int fd = ctx->len == 4 ? ctx->text[0] - '0' : (ctx->text[0] == '<' ? 0 : 1);
+		bool before_files = t->in[s] == CT_NIL && t->out[s] == CT_NIL &&
+			t->err[s] == CT_NIL;
+
+		t->dup[s] = ct_append_dup(t, t->dup[s], fd, last == '-' ? -1 : last - '0',
+			before_files);
+		next_token(ctx);
+		if (ctx->type == TOK_BLANK)
+			next_token(ctx);
+		return true;
+	}
+
+	next_token(ctx);
+	if (ctx->type == TOK_BLANK)
+		next_token(ctx);
+
+	w = parse_word(ctx);
+	if (w == CT_NIL)
+		return false;
+
+	switch (type) {
+	case TOK_REDIRECT_OE:
+		t->out[s] = ct_append_word(t, t->out[s], w);
+		t->err[s] = ct_append_word(t, t->err[s], w);
+		break;
+	case TOK_REDIRECT_E:
+		t->err[s] = ct_append_word(t, t->err[s], w);
+		break;
+	case TOK_REDIRECT_O:
+		t->out[s] = ct_append_word(t, t->out[s], w);
+		break;
+	case TOK_REDIRECT_APPEND_E:
+		t->err[s] = ct_append_word(t, t->err[s], w);
+		t->io_flags[s] |= IO_ERR_APPEND;
+		break;
+	case TOK_REDIRECT_APPEND_O:
+		t->out[s] = ct_append_word(t, t->out[s], w);
+		t->io_flags[s] |= IO_OUT_APPEND;
+		break;
+	default:
+		t->in[s] = ct_append_word(t, t->in[s], w);
+		break;
+	}
+
+	if (ctx->type == TOK_BLANK)
+		next_token(ctx);
+
+	return true;
+}
+
+
+/*
+ * simple_command: [BLANK] word [BLANK [word (BLANK word)* [BLANK]]] redirect*
+ * (after_blank is set when the leading blank was already consumed)
+ */
+static ct_index_t parse_simple(rd_context_t * ctx, bool after_blank)
+{
+	ct_index_t verb, params = CT_NIL, last = CT_NIL, s;
+
+	if (!after_blank && ctx->type == TOK_BLANK)
+		next_token(ctx);
+
+	verb = parse_word(ctx);
+	if (verb == CT_NIL)
+		return CT_NIL;
+
+	if (ctx->type == TOK_BLANK) {
+		next_token(ctx);
+		while (is_word_token(ctx)) {
+			ct_index_t w = parse_word(ctx);
+
+			if (last == CT_NIL)
+				params = w;
+			else
+				ctx->tree.next_word[last] = w;
+			last = w;
+
+			if (ctx->type != TOK_BLANK)
+				break;
+			next_token(ctx);
+		}
+	}
+
+	s = ct_add_simple(&ctx->tree, verb, params);
+	while (is_redirect_token(ctx))
+		if (!parse_redirect(ctx, s))
+			return CT_NIL;
+
+	return ct_add_command(&ctx->tree, OP_NONE, CT_NIL, CT_NIL, s);
+}
+
+
+static ct_index_t parse_command(rd_context_t * ctx, int min_prec, bool after_blank);
+
+
+/*
+ * group: (BRACE_OPEN BLANK command SEQUENTIAL [BLANK] BRACE_CLOSE |
+ *	PAREN_OPEN command [SEQUENTIAL [BLANK]] PAREN_CLOSE) [BLANK] redirect*
+ */
+static ct_index_t parse_group(rd_context_t * ctx)
+{
+	bool brace = ctx->type == TOK_BRACE_OPEN;
+	ct_index_t body, s;
+
+	next_token(ctx);
+	if (brace && ctx->type != TOK_BLANK)
+		return fail(ctx);
+
+	ctx->depth++;
+	ctx->sequential_end = false;
+	body = parse_command(ctx, 1, false);
+	ctx->depth--;
+	if (body == CT_NIL)
+		return CT_NIL;
+	if (ctx->type != (brace ? TOK_BRACE_CLOSE : TOK_PAREN_CLOSE) ||
+		(brace && !ctx->sequential_end))
+		return fail(ctx);
+	ctx->sequential_end = false;
+
+	next_token(ctx);
+	if (ctx->type == TOK_BLANK)
+		next_token(ctx);
+
+	s = ct_add_simple(&ctx->tree, CT_NIL, CT_NIL);
+	while (is_redirect_token(ctx))
+		if (!parse_redirect(ctx, s))
+			return CT_NIL;
+
+	return ct_add_command(&ctx->tree, brace ? OP_BRACE_GROUP : OP_SUBSHELL, body, CT_NIL, s);
+}
+
+
+/* A simple command or a group, after an optional blank */
+static ct_index_t parse_operand(rd_context_t * ctx, bool after_blank)
+{
+	if (!after_blank && ctx->type == TOK_BLANK)
+		next_token(ctx);
+
+	if (ctx->type == TOK_BRACE_OPEN || ctx->type == TOK_PAREN_OPEN)
+		return parse_group(ctx);
+
+	return parse_simple(ctx, true);
+}
+
+
+/* Binding strength of an operator (0 for other tokens), as in parser.y */
+static int precedence(token_type_t type, operator_t * op)
+{
+	switch (type) {
+	case TOK_SEQUENTIAL:
+		*op = OP_SEQUENTIAL;
+		return 1;
+	case TOK_PARALLEL:
+		*op = OP_PARALLEL;
+		return 2;
+	case TOK_CONDITIONAL_ZERO:
+		*op = OP_CONDITIONAL_ZERO;
+		return 3;
+	case TOK_CONDITIONAL_NZERO:
+		*op = OP_CONDITIONAL_NZERO;
+		return 3;
+	case TOK_FANOUT:
+		*op = OP_FANOUT;
+		return 4;
+	case TOK_PIPE:
+		*op = OP_PIPE;
+		return 5;
+	default:
+		return 0;
+	}
+}
+
+
+/* command: operators of at least min_prec, all left associative */
+static ct_index_t parse_command(rd_context_t * ctx, int min_prec, bool after_blank)
+{
+	ct_index_t lhs = parse_operand(ctx, after_blank);
+	operator_t op = OP_NONE;
+	int prec;
+
+	while (lhs != CT_NIL && (prec = precedence(ctx->type, &op)) >= min_prec && prec > 0) {
+		ct_index_t rhs;
+		bool blank = false;
+
+		next_token(ctx);
+		if (op == OP_SEQUENTIAL && ctx->depth > 0) {
+			/* the last command of a group can end with ';' */
+			if (ctx->type == TOK_BLANK) {
+				next_token(ctx);
+				blank = true;
+			}
+			if (is_close_token(ctx)) {
+				ctx->sequential_end = true;
+				return lhs;
+			}
+		}
+		rhs = parse_command(ctx, prec + 1, blank);
+		if (rhs == CT_NIL)
+			return CT_NIL;
+		lhs = ct_add_command(&ctx->tree, op, lhs, rhs, CT_NIL);
+	}
+
+	return lhs;
+}
+
+
+rd_context_t * rd_create(void)
+{
+	rd_context_t * ctx = (rd_context_t *)malloc(sizeof(rd_context_t));
+
+	if (ctx != NULL) {
+		memset(ctx, 0, sizeof(*ctx));
+		ct_init(&ctx->tree);
+	}
+
+	return ctx;
+}
+
+
+const ct_tree_t * rd_parse_compact(rd_context_t * ctx, const char * line, size_t len, int * where)
+{
+	ct_index_t c = CT_NIL;
+	bool after_blank = false;
+
+	ct_clear(&ctx->tree);
+	ctx->p = line;
+	ctx->end = line + strnlen(line, len);
+	ctx->state = IN_INITIAL;
+	ctx->first_column = ctx->last_column = 0;
+	ctx->depth = 0;
+	ctx->failed = false;
+
+	next_token(ctx);
+	if (ctx->type == TOK_BLANK) {
+		next_token(ctx);
+		after_blank = true;
+	}
+
+	if (ctx->type != TOK_END_OF_LINE && ctx->type != TOK_END_OF_FILE) {
+		c = parse_command(ctx, 1, after_blank);
+		if (c != CT_NIL && ctx->type != TOK_END_OF_LINE && ctx->type != TOK_END_OF_FILE)
+			fail(ctx);
+	}
+
+	if (ctx->failed) {
+		*where = ctx->error_column;
+		return NULL;
+	}
+
+	ctx->tree.root = c;
+	return &ctx->tree;
+}
+
+
+bool rd_parse(rd_context_t * ctx, const char * line, size_t len, command_t ** root, int * where)
+{
+	const ct_tree_t * tree = rd_parse_compact(ctx, line, len, where);
+	size_t size;
+
+	if (tree == NULL)
+		return false;
+
+	size = ct_command_size(tree);
+	if (size > ctx->nodes_size) {
+		free(ctx->nodes);
+		ctx->nodes = malloc(size);
+		if (ctx->nodes == NULL) {
+			fprintf(stderr, "malloc() failed\n");
+			exit(EXIT_FAILURE);
+		}
+		ctx->nodes_size = size;
+	}
+
+	*root = ct_to_command(tree, ctx->nodes);
+	return true;
+}
+
+
+void rd_reset(rd_context_t * ctx)
+{
+	/* the memory is kept for the next line */
+	ct_clear(&ctx->tree);
+}
+
+
+void rd_destroy(rd_context_t * ctx)
+{
+	ct_free(&ctx->tree);
+	free(ctx->nodes);
+	free(ctx);
+}
+
+
+/*
+ * parser.h interface, on a context of its own (left out with
+ * -DRD_REENTRANT_ONLY, to link next to another parser)
+ */
+
+#ifndef RD_REENTRANT_ONLY
+
+static rd_context_t * global_context;
+
+
+static bool parse(const char * line, size_t len, command_t ** root)
+{
+	int where;
+
+	free_parse_memory();
+	if (global_context == NULL) {
+		global_context = rd_create();
+		if (global_context == NULL) {
+			fprintf(stderr, "malloc() failed\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (!rd_parse(global_context, line, len, root, &where)) {
+		parse_error("syntax error", where);
+		return false;
+	}
+
+	return true;
+}
+
+
+bool parse_line(const char * line, command_t ** root)
+{
+	if (*root != NULL || line == NULL) {
+		/* see the comment in parser.h */
+		assert(false);
+		return false;
+	}
+
+	return parse(line, strlen(line), root);
+}
+
+
+bool parse_line_buffer(char * buffer, size_t size, command_t ** root)
+{
+	if (*root != NULL || buffer == NULL || size < 2 || buffer[size - 2] != '\0' || buffer[size - 1] != '\0') {
+		/* see the comment in parser.h */
+		assert(false);
+		return false;
+	}
+
+	return parse(buffer, strlen(buffer), root);
+}
+
+
+void free_parse_memory(void)
+{
+	if (global_context != NULL)
+		rd_reset(global_context);
+}
+
+#endif
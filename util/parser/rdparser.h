@@ -0,0 +1,78 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+
+#ifndef __RDPARSER_H
+#define __RDPARSER_H
+
+/*
+ * Reentrant interface of the hand-written parser (rdparser.c, selected
+ * with make PARSER=rd)
+
+ * Every rd_context_t holds its own lexer state and the memory of its
+ * trees, so several lines can be parsed at the same time (e.g. by
+ * different threads) with different contexts. parse_line() and
+ * free_parse_memory() use a context of their own.
+ */
+
+#include "parser.h"
+#include "ctree.h"
+
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+typedef struct rd_context rd_context_t;
+
+
+/*
+ * Create a parser context (NULL if out of memory)
+ */
+
+rd_context_t * rd_create(void);
+
+
+/*
+ * Parse a single line, as parse_line does, of len bytes (or up to a NUL)
+
+ * Returns true if the line is valid and sets (*root) like parse_line;
+ * the tree stays valid until the next rd_parse() or rd_reset() on ctx.
+ * On a syntax error returns false and (*where) is set to the column of
+ * the offending token (where parse_line would report it).
+ */
+
+bool rd_parse(rd_context_t * ctx, const char * line, size_t len,
+	command_t ** root, int * where);
+
+
+/*
+ * Same as rd_parse(), but returns the compact tree (ctree.h) instead of
+ * parser.h structures, NULL on a syntax error; the tree stays valid until
+ * the next parse or rd_reset() on ctx
+ */
+
+const ct_tree_t * rd_parse_compact(rd_context_t * ctx, const char * line,
+	size_t len, int * where);
+
+
+/*
+ * Free the trees parsed with ctx (the context can be used again)
+ */
+
+void rd_reset(rd_context_t * ctx);
+
+
+/*
+ * Free a context and all its trees
+ */
+
+void rd_destroy(rd_context_t * ctx);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif